@@ -0,0 +1,90 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ast-budget.h"
+
+void ast_budget_init(AstBudget *budget, int server_kbps, int client_kbps)
+{
+    memset(budget, 0, sizeof(*budget));
+    budget->server_kbps = MAX(server_kbps, 0);
+    budget->client_kbps = MAX(client_kbps, 0);
+}
+
+int ast_budget_enabled(AstBudget *budget)
+{
+    return budget->server_kbps > 0 || budget->client_kbps > 0;
+}
+
+static int ast_budget_rate(AstBudget *budget, int viewers)
+{
+    int rate = budget->client_kbps;
+
+    if (budget->server_kbps > 0) {
+        int share = budget->server_kbps / MAX(viewers, 1);
+
+        rate = rate > 0 ? MIN(rate, share) : share;
+    }
+    return MAX(rate, 1);
+}
+
+/* kbit/s are bytes per 8 ms */
+static void ast_budget_fill(AstBudget *budget, gint64 now, int viewers)
+{
+    int rate = ast_budget_rate(budget, viewers);
+    gint64 burst = (gint64)rate * AST_BUDGET_BURST_MS / 8;
+    gint64 tokens;
+
+    if (budget->last_fill == 0) {
+        tokens = burst;
+    } else {
+        tokens = budget->tokens + (now - budget->last_fill) * rate / 8000;
+        tokens = MIN(tokens, burst);
+    }
+    __atomic_store_n(&budget->rate_kbps, rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&budget->tokens, tokens, __ATOMIC_RELAXED);
+    budget->last_fill = now;
+}
+
+int ast_budget_delay(AstBudget *budget, gint64 now, int viewers)
+{
+    if (!ast_budget_enabled(budget)) {
+        return 0;
+    }
+    ast_budget_fill(budget, now, viewers);
+    if (budget->tokens >= 0) {
+        return 0;
+    }
+    __atomic_add_fetch(&budget->held, 1, __ATOMIC_RELAXED);
+    /* round up, or the next call finds the bucket still short */
+    return (-budget->tokens * 8 + budget->rate_kbps - 1) / budget->rate_kbps;
+}
+
+void ast_budget_charge(AstBudget *budget, uint32_t size)
+{
+    if (!ast_budget_enabled(budget)) {
+        return;
+    }
+    __atomic_store_n(&budget->tokens, budget->tokens - size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&budget->frames, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&budget->bytes, size, __ATOMIC_RELAXED);
+}
+
+void ast_budget_print(AstBudget *budget)
+{
+    gint64 tokens = __atomic_load_n(&budget->tokens, __ATOMIC_RELAXED);
+
+    if (!ast_budget_enabled(budget)) {
+        return;
+    }
+    /* the capture side keeps counting while these are taken */
+    printf("budget: %d kbps (server %d, client %d), %" G_GUINT64_FORMAT " frames, %.1f KB,"
+           " %" G_GUINT64_FORMAT " captures held, %.1f KB %s\n",
+           __atomic_load_n(&budget->rate_kbps, __ATOMIC_RELAXED),
+           budget->server_kbps, budget->client_kbps,
+           __atomic_exchange_n(&budget->frames, 0, __ATOMIC_RELAXED),
+           __atomic_exchange_n(&budget->bytes, 0, __ATOMIC_RELAXED) / 1024.0,
+           __atomic_exchange_n(&budget->held, 0, __ATOMIC_RELAXED),
+           (tokens < 0 ? -tokens : tokens) / 1024.0, tokens < 0 ? "in debt" : "available");
+}
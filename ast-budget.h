@@ -0,0 +1,56 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef __AST_BUDGET_H__
+#define __AST_BUDGET_H__
+
+#include <stdint.h>
+#include <glib.h>
+
+/*
+ * Bandwidth budget of the console stream, so it can't starve the other
+ * traffic on the BMC's NIC.
+ *
+ * A token bucket, filled at the budget's rate and charged with the size
+ * of every frame handed to spice, when it is queued. Frames dropped on
+ * the way (duplicates, gaps, a full ring) cost nothing. The size is only
+ * known after the frame is captured, so a frame may leave the bucket in
+ * debt; no frame is captured until the debt is paid off. The engine keeps
+ * collecting changes meanwhile, so the next frame carries all of them
+ * and the stream still ends on the latest screen.
+ *
+ * Every display client gets every frame: the rate is the per client
+ * budget, or the server budget shared by the viewers, whichever is lower.
+ *
+ * Frames are charged with the engine's compressed size, MJPEG stream
+ * frames with the message queued and solid fills with the fill command.
+ * With --image=bitmap the compressed size is a stand-in: spice sends the
+ * decoded area with its own image compression, whose output size never
+ * comes back here.
+ *
+ * Capture side only, printed from the main loop; the counters and the
+ * bucket level the print reads are relaxed atomics.
+ */
+
+/* bucket depth, in time at the current rate */
+#define AST_BUDGET_BURST_MS 250
+
+typedef struct AstBudget {
+    int server_kbps;        /* 0: unlimited */
+    int client_kbps;        /* 0: unlimited */
+    int rate_kbps;          /* current fill rate */
+
+    gint64 tokens;          /* bytes, negative while in debt */
+    gint64 last_fill;
+
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t held;          /* captures put off for lack of tokens */
+} AstBudget;
+
+void ast_budget_init(AstBudget *budget, int server_kbps, int client_kbps);
+int ast_budget_enabled(AstBudget *budget);
+/* ms until the next frame may be captured, 0 if now */
+int ast_budget_delay(AstBudget *budget, gint64 now, int viewers);
+void ast_budget_charge(AstBudget *budget, uint32_t size);
+void ast_budget_print(AstBudget *budget);
+
+#endif /* __AST_BUDGET_H__ */
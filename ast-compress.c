@@ -0,0 +1,217 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <config.h>
+#include <stdio.h>
+
+#include "ast-compress.h"
+
+#define AST_COMPRESS_WINDOW_US      G_USEC_PER_SEC
+/* windows under target needed before raising the quality again */
+#define AST_COMPRESS_RECOVER_WINDOWS 3
+/* "well under" the bandwidth target, in percent */
+#define AST_COMPRESS_HEADROOM       60
+
+static const AstQuality ast_quality_ladder[] = {
+    { 11, 11, FALSE },
+    {  9, 11, FALSE },
+    {  7,  9, FALSE },
+    {  7,  9, TRUE  },
+    {  5,  7, TRUE  },
+    {  4,  6, TRUE  },
+    {  2,  4, TRUE  },
+    {  0,  2, TRUE  },
+};
+
+#define AST_QUALITY_LEVELS ((int)G_N_ELEMENTS(ast_quality_ladder))
+
+void ast_compress_init(AstCompress *compress, int target_kbps, int target_latency_ms)
+{
+    compress->target_kbps = MAX(target_kbps, 0);
+    compress->target_latency_ms = MAX(target_latency_ms, 0);
+    compress->spice_level = -1;
+    compress->level = 0;
+    compress->under = 0;
+    compress->changes = 0;
+    compress->window_start = g_get_monotonic_time();
+    compress->window_bytes = 0;
+    compress->kbps = 0;
+    compress->latency_ms = 0;
+    compress->refine_ms = 0;
+    compress->motion_level = 0;
+    compress->changed = FALSE;
+    compress->static_since = compress->window_start;
+    compress->refining = FALSE;
+    compress->refine_frame = FALSE;
+    compress->refinements = 0;
+}
+
+void ast_compress_set_refine(AstCompress *compress, int refine_ms, int motion_level)
+{
+    compress->refine_ms = MAX(refine_ms, 0);
+    compress->motion_level = CLAMP(motion_level, 0, AST_QUALITY_LEVELS - 1);
+}
+
+static int ast_compress_has_target(AstCompress *compress)
+{
+    return compress->target_kbps > 0 || compress->target_latency_ms > 0;
+}
+
+int ast_compress_enabled(AstCompress *compress)
+{
+    return ast_compress_has_target(compress) || compress->refine_ms > 0 ||
+           __atomic_load_n(&compress->spice_level, __ATOMIC_RELAXED) >= 0;
+}
+
+void ast_compress_set_spice_level(AstCompress *compress, int level)
+{
+    __atomic_store_n(&compress->spice_level, CLAMP(level, 0, 9), __ATOMIC_RELAXED);
+}
+
+void ast_compress_capture(AstCompress *compress, uint32_t size)
+{
+    compress->window_bytes += size;
+    compress->changed = TRUE;
+}
+
+/* best rung spice allows */
+static int ast_compress_floor(AstCompress *compress)
+{
+    int spice_level = __atomic_load_n(&compress->spice_level, __ATOMIC_RELAXED);
+
+    if (spice_level < 0) {
+        return 0;
+    }
+    return spice_level * (AST_QUALITY_LEVELS - 1) / 9;
+}
+
+/* rung the engine runs at for a given level and refinement state */
+static int ast_compress_rung(AstCompress *compress, int level, int refining)
+{
+    if (compress->refine_ms == 0) {
+        return level;
+    }
+    if (refining) {
+        return ast_compress_floor(compress);
+    }
+    return MAX(level, compress->motion_level);
+}
+
+/* rung the engine runs at, capture side */
+static int ast_compress_effective(AstCompress *compress)
+{
+    return ast_compress_rung(compress, compress->level, compress->refining);
+}
+
+/* switch between motion and refinement quality, TRUE on a switch */
+static int ast_compress_refine(AstCompress *compress, gint64 now)
+{
+    int changed = compress->changed;
+
+    compress->changed = FALSE;
+    if (compress->refine_ms == 0) {
+        return FALSE;
+    }
+    if (changed && compress->refine_frame) {
+        /* the refinement frame itself, not a change on screen */
+        compress->refine_frame = FALSE;
+        return FALSE;
+    }
+    if (changed) {
+        compress->static_since = now;
+        if (compress->refining) {
+            __atomic_store_n(&compress->refining, FALSE, __ATOMIC_RELAXED);
+            return TRUE;
+        }
+        return FALSE;
+    }
+    if (!compress->refining && now - compress->static_since >= compress->refine_ms * 1000LL) {
+        __atomic_store_n(&compress->refining, TRUE, __ATOMIC_RELAXED);
+        compress->refine_frame = TRUE;
+        __atomic_store_n(&compress->refinements, compress->refinements + 1, __ATOMIC_RELAXED);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* returns TRUE when the quality changed and the engine must be reconfigured */
+int ast_compress_update(AstCompress *compress, gint64 now, int release_us)
+{
+    gint64 elapsed = now - compress->window_start;
+    int effective = ast_compress_effective(compress);
+    int level = compress->level;
+    int kbps, latency_ms;
+    int over, under;
+
+    if (!ast_compress_enabled(compress)) {
+        return FALSE;
+    }
+    ast_compress_refine(compress, now);
+    if (elapsed < AST_COMPRESS_WINDOW_US) {
+        return ast_compress_effective(compress) != effective;
+    }
+
+    kbps = compress->window_bytes * 8000 / elapsed;
+    latency_ms = release_us / 1000;
+    __atomic_store_n(&compress->kbps, kbps, __ATOMIC_RELAXED);
+    __atomic_store_n(&compress->latency_ms, latency_ms, __ATOMIC_RELAXED);
+    compress->window_start = now;
+    compress->window_bytes = 0;
+
+    over = (compress->target_kbps && kbps > compress->target_kbps) ||
+           (compress->target_latency_ms && latency_ms > compress->target_latency_ms);
+    under = (!compress->target_kbps ||
+             kbps < compress->target_kbps * AST_COMPRESS_HEADROOM / 100) &&
+            (!compress->target_latency_ms || latency_ms < compress->target_latency_ms / 2);
+
+    if (over) {
+        level++;
+        compress->under = 0;
+    } else if (under && ++compress->under >= AST_COMPRESS_RECOVER_WINDOWS) {
+        level--;
+        compress->under = 0;
+    } else if (!under) {
+        compress->under = 0;
+    }
+    if (!ast_compress_has_target(compress)) {
+        level = 0;
+    }
+    level = CLAMP(level, ast_compress_floor(compress), AST_QUALITY_LEVELS - 1);
+
+    if (level != compress->level) {
+        __atomic_store_n(&compress->level, level, __ATOMIC_RELAXED);
+        __atomic_store_n(&compress->changes, compress->changes + 1, __ATOMIC_RELAXED);
+    }
+    return ast_compress_effective(compress) != effective;
+}
+
+const AstQuality *ast_compress_quality(AstCompress *compress)
+{
+    return &ast_quality_ladder[ast_compress_effective(compress)];
+}
+
+int ast_compress_refine_started(AstCompress *compress)
+{
+    return compress->refining && compress->refine_frame;
+}
+
+/* main loop, the capture side keeps updating the fields it reads */
+void ast_compress_print(AstCompress *compress)
+{
+    int level = __atomic_load_n(&compress->level, __ATOMIC_RELAXED);
+    int refining = __atomic_load_n(&compress->refining, __ATOMIC_RELAXED);
+    const AstQuality *quality = &ast_quality_ladder[ast_compress_rung(compress, level, refining)];
+
+    printf("compress: level %d/%d (table %d adv %d %s), %d kbps, latency %d ms,"
+           " target %d kbps %d ms, spice %d, %d changes\n",
+           level, AST_QUALITY_LEVELS - 1, quality->jpeg_table,
+           quality->adv_table, quality->mode420 ? "4:2:0" : "4:4:4",
+           __atomic_load_n(&compress->kbps, __ATOMIC_RELAXED),
+           __atomic_load_n(&compress->latency_ms, __ATOMIC_RELAXED), compress->target_kbps,
+           compress->target_latency_ms,
+           __atomic_load_n(&compress->spice_level, __ATOMIC_RELAXED),
+           __atomic_load_n(&compress->changes, __ATOMIC_RELAXED));
+    if (compress->refine_ms) {
+        printf("refine: %s, motion level %d, %d refinement frames\n",
+               refining ? "settled" : "moving", compress->motion_level,
+               __atomic_load_n(&compress->refinements, __ATOMIC_RELAXED));
+    }
+}
@@ -0,0 +1,73 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef __AST_COMPRESS_H__
+#define __AST_COMPRESS_H__
+
+#include <stdint.h>
+#include <glib.h>
+
+/*
+ * Compression controller.
+ *
+ * Walks a ladder of engine quality settings, from the finest quant tables
+ * in 4:4:4 down to the coarsest ones in 4:2:0. Once per window it compares
+ * the compressed output rate and the queue to release latency against the
+ * configured targets: a window over target steps one rung down right away,
+ * several windows well under target step one rung back up. The level
+ * spice asks for through set_compression_level() caps the quality from
+ * above.
+ *
+ * With refinement on, changing frames are held at least at the motion
+ * rung, which is coarse and cheap. Once the screen has been static for
+ * refine_ms, the controller switches to the best rung allowed. The
+ * caller then asks the engine for one full frame at that quality. The
+ * next change drops back to motion quality.
+ *
+ * ast_compress_capture() and ast_compress_update() are called from the
+ * capture side, ast_compress_set_spice_level() from the red_worker thread
+ * and ast_compress_print() from the main loop. Fields another thread reads
+ * are stored with relaxed atomics.
+ */
+
+typedef struct AstQuality {
+    int jpeg_table;         /* DCT quant table, 0 (coarsest) - 11 */
+    int adv_table;          /* quant table of the sharp/second pass */
+    int mode420;            /* chroma subsampling */
+} AstQuality;
+
+#define AST_COMPRESS_MOTION_LEVEL_DEFAULT 4
+
+typedef struct AstCompress {
+    int target_kbps;        /* 0: no bandwidth target */
+    int target_latency_ms;  /* 0: no latency target */
+    int spice_level;        /* 0-9, -1 until spice sets one */
+
+    int refine_ms;          /* 0: no refinement */
+    int motion_level;       /* best rung while the screen changes */
+    int changed;            /* a changed frame since the last update */
+    gint64 static_since;
+    int refining;           /* the screen settled, at the best rung */
+    int refine_frame;       /* the refinement frame is still to come */
+    int refinements;
+
+    int level;              /* rung of the ladder, 0 = best quality */
+    int under;              /* consecutive windows well under target */
+    int changes;
+
+    gint64 window_start;
+    uint64_t window_bytes;
+    int kbps;               /* output rate of the last window */
+    int latency_ms;         /* release latency seen at the last window */
+} AstCompress;
+
+void ast_compress_init(AstCompress *compress, int target_kbps, int target_latency_ms);
+void ast_compress_set_refine(AstCompress *compress, int refine_ms, int motion_level);
+int ast_compress_enabled(AstCompress *compress);
+void ast_compress_set_spice_level(AstCompress *compress, int level);
+void ast_compress_capture(AstCompress *compress, uint32_t size);
+int ast_compress_update(AstCompress *compress, gint64 now, int release_us);
+const AstQuality *ast_compress_quality(AstCompress *compress);
+/* TRUE right after ast_compress_update() switched to refinement */
+int ast_compress_refine_started(AstCompress *compress);
+void ast_compress_print(AstCompress *compress);
+
+#endif /* __AST_COMPRESS_H__ */
@@ -0,0 +1,217 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/**
+ * Throughput of the scalar and vector decoder kernels.
+ *
+ * Runs the IDCT and the color conversion over synthetic data with both
+ * kernels, checks they agree and prints the rates. Given a frame saved
+ * with --dump-frames and the engine's quant tables (-q, as for
+ * --quant-tables) it also times decoding that frame end to end.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "spice-server-aspeed.h"
+#include "ast-decode.h"
+
+#define BENCH_BLOCKS 4096
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+
+static const char *kernel_names[2] = { "scalar", "simd" };
+
+static double elapsed_ms(gint64 start)
+{
+    return (g_get_monotonic_time() - start) / 1000.0;
+}
+
+static int bench_idct(int iterations)
+{
+    int16_t *coef = g_new(int16_t, BENCH_BLOCKS * 64);
+    int32_t *out[2] = { g_new(int32_t, BENCH_BLOCKS * 64), g_new(int32_t, BENCH_BLOCKS * 64) };
+    uint16_t quant[64];
+    int i, k, n;
+    int ret = 0;
+
+    /* a few low frequency coefficients per block, like real content */
+    memset(coef, 0, BENCH_BLOCKS * 64 * sizeof(*coef));
+    for (i = 0; i < BENCH_BLOCKS; i++) {
+        for (k = 0; k < 10; k++) {
+            coef[i * 64 + g_random_int_range(0, 24)] = g_random_int_range(-64, 64);
+        }
+    }
+    for (i = 0; i < 64; i++) {
+        quant[i] = g_random_int_range(1, 32);
+    }
+
+    for (k = 0; k < 2; k++) {
+        gint64 start = g_get_monotonic_time();
+        double ms;
+
+        for (n = 0; n < iterations; n++) {
+            for (i = 0; i < BENCH_BLOCKS; i++) {
+                if (k) {
+                    ast_idct_simd(coef + i * 64, quant, out[k] + i * 64);
+                } else {
+                    ast_idct_scalar(coef + i * 64, quant, out[k] + i * 64);
+                }
+            }
+        }
+        ms = elapsed_ms(start);
+        printf("idct %-6s: %8.2f Mblocks/s\n", kernel_names[k],
+               ms > 0 ? (double)BENCH_BLOCKS * iterations / ms / 1000.0 : 0.0);
+    }
+    if (memcmp(out[0], out[1], BENCH_BLOCKS * 64 * sizeof(int32_t)) != 0) {
+        printf("idct: scalar and simd results differ\n");
+        ret = -1;
+    }
+
+    g_free(coef);
+    g_free(out[0]);
+    g_free(out[1]);
+    return ret;
+}
+
+static int bench_rgb(int iterations)
+{
+    size_t pixels = BENCH_WIDTH * BENCH_HEIGHT;
+    uint8_t *planes = g_malloc(pixels * 3);
+    uint32_t *out[2] = { g_new(uint32_t, pixels), g_new(uint32_t, pixels) };
+    size_t i;
+    int k, n;
+    int ret = 0;
+
+    for (i = 0; i < pixels * 3; i++) {
+        planes[i] = g_random_int_range(0, 256);
+    }
+
+    for (k = 0; k < 2; k++) {
+        gint64 start = g_get_monotonic_time();
+        double ms;
+
+        for (n = 0; n < iterations; n++) {
+            if (k) {
+                ast_yuv_to_rgb_simd(planes, planes + pixels, planes + pixels * 2,
+                                    out[k], pixels);
+            } else {
+                ast_yuv_to_rgb_scalar(planes, planes + pixels, planes + pixels * 2,
+                                      out[k], pixels);
+            }
+        }
+        ms = elapsed_ms(start);
+        printf("rgb  %-6s: %8.2f Mpixels/s, %.2f ms per %dx%d frame\n", kernel_names[k],
+               ms > 0 ? (double)pixels * iterations / ms / 1000.0 : 0.0,
+               ms / iterations, BENCH_WIDTH, BENCH_HEIGHT);
+    }
+    if (memcmp(out[0], out[1], pixels * sizeof(uint32_t)) != 0) {
+        printf("rgb: scalar and simd results differ\n");
+        ret = -1;
+    }
+
+    g_free(planes);
+    g_free(out[0]);
+    g_free(out[1]);
+    return ret;
+}
+
+/* a frame as written by --dump-frames: header, then the payload at the data offset */
+static int bench_frame(const char *path, int iterations)
+{
+    gchar *contents;
+    gsize length;
+    struct ASTHeader *hdr;
+    AstDecodeParams params;
+    AstDecodeRect dirty;
+    uint32_t *rgb;
+    int k, n;
+
+    if (!g_file_get_contents(path, &contents, &length, NULL) ||
+        length < AST_VIDEOCAP_DATA_OFFSET) {
+        printf("%s: can't read a frame\n", path);
+        return -1;
+    }
+    hdr = (struct ASTHeader *)contents;
+    if (hdr->src_mode_x <= 0 || hdr->src_mode_y <= 0 ||
+        hdr->src_mode_x > MAX_WIDTH || hdr->src_mode_y > MAX_HEIGHT ||
+        hdr->comp_size <= 0 || length < AST_VIDEOCAP_DATA_OFFSET + (gsize)hdr->comp_size) {
+        printf("%s: bad header\n", path);
+        g_free(contents);
+        return -1;
+    }
+
+    params.info.width = hdr->src_mode_x;
+    params.info.height = hdr->src_mode_y;
+    params.info.mode420 = hdr->mode420;
+    params.jpeg_table = hdr->jpeg_table;
+    params.adv_table = hdr->adv_table;
+    rgb = g_new(uint32_t, params.info.width * params.info.height);
+    printf("frame %dx%d %s, %d bytes, %d blocks\n", params.info.width, params.info.height,
+           params.info.mode420 ? "4:2:0" : "4:4:4", hdr->comp_size, hdr->num_of_MB);
+
+    for (k = 0; k < 2; k++) {
+        AstDecoder dec;
+        gint64 start;
+        double ms;
+
+        ast_decoder_init(&dec, k);
+        ast_decoder_resize(&dec, params.info.width, params.info.height);
+        start = g_get_monotonic_time();
+        for (n = 0; n < iterations; n++) {
+            if (ast_decode_frame(&dec, &params, (uint8_t *)contents + AST_VIDEOCAP_DATA_OFFSET,
+                                 hdr->comp_size, &dirty) < 0) {
+                printf("frame: decoding failed\n");
+                break;
+            }
+            ast_decode_rgb(&dec, &dirty, rgb, dirty.right - dirty.left);
+        }
+        ms = elapsed_ms(start);
+        printf("frame %-6s: %.2f ms per frame\n", kernel_names[k], n ? ms / n : 0.0);
+        ast_decoder_free(&dec);
+    }
+
+    g_free(rgb);
+    g_free(contents);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 50;
+    int ret = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:q:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = MAX(atoi(optarg), 1);
+            break;
+        case 'q':
+            if (ast_quant_tables_load(optarg) < 0) {
+                printf("%s: can't read quant tables\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            printf("usage: %s [-n ITERATIONS] [-q QUANT_TABLES FRAME]\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (bench_idct(iterations) < 0) {
+        ret = 1;
+    }
+    if (bench_rgb(iterations) < 0) {
+        ret = 1;
+    }
+    if (optind < argc && !ast_quant_tables_loaded()) {
+        printf("decoding a frame needs the engine's quant tables, see -q\n");
+        ret = 1;
+    } else if (optind < argc && bench_frame(argv[optind], iterations) < 0) {
+        ret = 1;
+    }
+    return ret;
+}
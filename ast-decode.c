@@ -0,0 +1,464 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "ast-decode.h"
+
+/* ---------- quant tables ---------- */
+
+/*
+ * The engine's 12 quant tables, luma and chroma, natural order. They are
+ * not in the stream and the driver has no way to read them back, so they
+ * come from a file holding the tables of the vendor's client decoder:
+ * for table 0 to 11, 64 luma then 64 chroma values, separated by white
+ * space or commas, '#' starting a comment.
+ */
+static uint16_t engine_quant[AST_QUANT_TABLES][2][64];
+static int engine_quant_loaded;
+
+int ast_quant_tables_load(const char *path)
+{
+    gchar *contents;
+    char *p, *end;
+    int n = 0;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return -1;
+    }
+    for (p = contents; *p && n < AST_QUANT_TABLES * 2 * 64; ) {
+        long v;
+
+        if (*p == '#') {
+            p += strcspn(p, "\n");
+            continue;
+        }
+        if (g_ascii_isspace(*p) || *p == ',') {
+            p++;
+            continue;
+        }
+        v = strtol(p, &end, 0);
+        if (end == p || v < 1 || v > 255) {
+            break;
+        }
+        engine_quant[n / 128][n / 64 % 2][n % 64] = v;
+        n++;
+        p = end;
+    }
+    g_free(contents);
+    if (n < AST_QUANT_TABLES * 2 * 64) {
+        return -1;
+    }
+    engine_quant_loaded = TRUE;
+    return 0;
+}
+
+int ast_quant_tables_loaded(void)
+{
+    return engine_quant_loaded;
+}
+
+void ast_quant_table(uint16_t *quant, int chroma, int table)
+{
+    memcpy(quant, engine_quant[CLAMP(table, 0, AST_QUANT_TABLES - 1)][chroma ? 1 : 0],
+           64 * sizeof(uint16_t));
+}
+
+static void update_quant(AstDecoder *dec, const AstDecodeParams *params)
+{
+    int tables[2] = { params->jpeg_table, params->adv_table };
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (dec->quant_tables[i] == tables[i]) {
+            continue;
+        }
+        ast_quant_table(dec->quant[i][0], FALSE, tables[i]);
+        ast_quant_table(dec->quant[i][1], TRUE, tables[i]);
+        dec->quant_tables[i] = tables[i];
+    }
+}
+
+/* ---------- IDCT ---------- */
+
+/*
+ * Integer IDCT of the IJG "islow" kind: an 8-point 1-D transform over
+ * the columns, then over the rows, with 13 bits of fixed point constants
+ * and 2 extra bits kept between the passes. The 1-D step is written once
+ * for any type supporting the arithmetic operators, so the same code
+ * runs on int32_t and on a vector of four int32_t.
+ */
+#define CONST_BITS 13
+#define PASS1_BITS 2
+
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+
+#define DEFINE_IDCT_1D(name, T)                                         \
+static inline void name(T *s, int step, int shift)                      \
+{                                                                       \
+    T z1, z2, z3, z4, z5;                                               \
+    T tmp0, tmp1, tmp2, tmp3;                                           \
+    T tmp10, tmp11, tmp12, tmp13;                                       \
+                                                                        \
+    /* even part */                                                     \
+    z2 = s[2 * step];                                                   \
+    z3 = s[6 * step];                                                   \
+    z1 = (z2 + z3) * FIX_0_541196100;                                   \
+    tmp2 = z1 - z3 * FIX_1_847759065;                                   \
+    tmp3 = z1 + z2 * FIX_0_765366865;                                   \
+                                                                        \
+    z2 = s[0];                                                          \
+    z3 = s[4 * step];                                                   \
+    tmp0 = ((z2 + z3) << CONST_BITS) + (1 << (shift - 1));              \
+    tmp1 = ((z2 - z3) << CONST_BITS) + (1 << (shift - 1));              \
+                                                                        \
+    tmp10 = tmp0 + tmp3;                                                \
+    tmp13 = tmp0 - tmp3;                                                \
+    tmp11 = tmp1 + tmp2;                                                \
+    tmp12 = tmp1 - tmp2;                                                \
+                                                                        \
+    /* odd part */                                                      \
+    tmp0 = s[7 * step];                                                 \
+    tmp1 = s[5 * step];                                                 \
+    tmp2 = s[3 * step];                                                 \
+    tmp3 = s[1 * step];                                                 \
+                                                                        \
+    z1 = tmp0 + tmp3;                                                   \
+    z2 = tmp1 + tmp2;                                                   \
+    z3 = tmp0 + tmp2;                                                   \
+    z4 = tmp1 + tmp3;                                                   \
+    z5 = (z3 + z4) * FIX_1_175875602;                                   \
+                                                                        \
+    tmp0 = tmp0 * FIX_0_298631336;                                      \
+    tmp1 = tmp1 * FIX_2_053119869;                                      \
+    tmp2 = tmp2 * FIX_3_072711026;                                      \
+    tmp3 = tmp3 * FIX_1_501321110;                                      \
+    z1 = z1 * -FIX_0_899976223;                                         \
+    z2 = z2 * -FIX_2_562915447;                                         \
+    z3 = z3 * -FIX_1_961570560 + z5;                                    \
+    z4 = z4 * -FIX_0_390180644 + z5;                                    \
+                                                                        \
+    tmp0 += z1 + z3;                                                    \
+    tmp1 += z2 + z4;                                                    \
+    tmp2 += z2 + z3;                                                    \
+    tmp3 += z1 + z4;                                                    \
+                                                                        \
+    s[0 * step] = (tmp10 + tmp3) >> shift;                              \
+    s[7 * step] = (tmp10 - tmp3) >> shift;                              \
+    s[1 * step] = (tmp11 + tmp2) >> shift;                              \
+    s[6 * step] = (tmp11 - tmp2) >> shift;                              \
+    s[2 * step] = (tmp12 + tmp1) >> shift;                              \
+    s[5 * step] = (tmp12 - tmp1) >> shift;                              \
+    s[3 * step] = (tmp13 + tmp0) >> shift;                              \
+    s[4 * step] = (tmp13 - tmp0) >> shift;                              \
+}
+
+DEFINE_IDCT_1D(idct_1d_scalar, int32_t)
+
+void ast_idct_scalar(const int16_t *coef, const uint16_t *quant, int32_t *out)
+{
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        out[i] = coef[i] * quant[i];
+    }
+    for (i = 0; i < 8; i++) {
+        idct_1d_scalar(out + i, 8, CONST_BITS - PASS1_BITS);
+    }
+    for (i = 0; i < 8; i++) {
+        idct_1d_scalar(out + i * 8, 1, CONST_BITS + PASS1_BITS + 3);
+    }
+}
+
+typedef int32_t v4si __attribute__((vector_size(16)));
+
+DEFINE_IDCT_1D(idct_1d_simd, v4si)
+
+#ifdef __clang__
+#define SHUFFLE(a, b, i0, i1, i2, i3) __builtin_shufflevector(a, b, i0, i1, i2, i3)
+#else
+#define SHUFFLE(a, b, i0, i1, i2, i3) __builtin_shuffle(a, b, (v4si){ i0, i1, i2, i3 })
+#endif
+
+static inline void transpose4(v4si *a, v4si *b, v4si *c, v4si *d)
+{
+    v4si t0 = SHUFFLE(*a, *b, 0, 4, 1, 5);
+    v4si t1 = SHUFFLE(*a, *b, 2, 6, 3, 7);
+    v4si t2 = SHUFFLE(*c, *d, 0, 4, 1, 5);
+    v4si t3 = SHUFFLE(*c, *d, 2, 6, 3, 7);
+
+    *a = SHUFFLE(t0, t2, 0, 1, 4, 5);
+    *b = SHUFFLE(t0, t2, 2, 3, 6, 7);
+    *c = SHUFFLE(t1, t3, 0, 1, 4, 5);
+    *d = SHUFFLE(t1, t3, 2, 3, 6, 7);
+}
+
+/* m[row * 2 + half] holds columns 4 * half .. 4 * half + 3 of row */
+static inline void transpose8(v4si *m)
+{
+    v4si t;
+    int k;
+
+    transpose4(&m[0], &m[2], &m[4], &m[6]);
+    transpose4(&m[1], &m[3], &m[5], &m[7]);
+    transpose4(&m[8], &m[10], &m[12], &m[14]);
+    transpose4(&m[9], &m[11], &m[13], &m[15]);
+    for (k = 0; k < 4; k++) {
+        t = m[k * 2 + 1];
+        m[k * 2 + 1] = m[8 + k * 2];
+        m[8 + k * 2] = t;
+    }
+}
+
+/* both passes run on four columns at a time, with a transpose in between */
+void ast_idct_simd(const int16_t *coef, const uint16_t *quant, int32_t *out)
+{
+    v4si m[16];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        const int16_t *c = coef + i * 4;
+        const uint16_t *q = quant + i * 4;
+
+        m[i] = (v4si){ c[0], c[1], c[2], c[3] } * (v4si){ q[0], q[1], q[2], q[3] };
+    }
+    idct_1d_simd(m, 2, CONST_BITS - PASS1_BITS);
+    idct_1d_simd(m + 1, 2, CONST_BITS - PASS1_BITS);
+    transpose8(m);
+    idct_1d_simd(m, 2, CONST_BITS + PASS1_BITS + 3);
+    idct_1d_simd(m + 1, 2, CONST_BITS + PASS1_BITS + 3);
+    transpose8(m);
+    memcpy(out, m, sizeof(m));
+}
+
+/* ---------- color conversion ---------- */
+
+void ast_yuv_to_rgb_scalar(const uint8_t *y, const uint8_t *cb, const uint8_t *cr,
+                           uint32_t *dst, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = ast_stream_vq_rgb((y[i] << 16) | (cb[i] << 8) | cr[i]);
+    }
+}
+
+static inline v4si clamp_u8x4(v4si x)
+{
+    v4si over;
+
+    x &= ~(x >> 31);
+    over = x > 255;
+    return (x & ~over) | (over & 255);
+}
+
+/* same fixed point math as ast_stream_vq_rgb(), four pixels at a time */
+void ast_yuv_to_rgb_simd(const uint8_t *y, const uint8_t *cb, const uint8_t *cr,
+                         uint32_t *dst, int n)
+{
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        v4si l = { y[i], y[i + 1], y[i + 2], y[i + 3] };
+        v4si u = (v4si){ cb[i], cb[i + 1], cb[i + 2], cb[i + 3] } - 128;
+        v4si v = (v4si){ cr[i], cr[i + 1], cr[i + 2], cr[i + 3] } - 128;
+        v4si r = clamp_u8x4(l + ((91881 * v) >> 16));
+        v4si g = clamp_u8x4(l - ((22554 * u + 46802 * v) >> 16));
+        v4si b = clamp_u8x4(l + ((116130 * u) >> 16));
+        v4si px = (r << 16) | (g << 8) | b;
+
+        memcpy(dst + i, &px, sizeof(px));
+    }
+    ast_yuv_to_rgb_scalar(y + i, cb + i, cr + i, dst + i, n - i);
+}
+
+/* ---------- decoder ---------- */
+
+#define PLANE_ALIGN 16      /* largest macroblock */
+
+void ast_decoder_init(AstDecoder *dec, int simd)
+{
+    memset(dec, 0, sizeof(*dec));
+    dec->simd = simd;
+    dec->quant_tables[0] = -1;
+    dec->quant_tables[1] = -1;
+}
+
+void ast_decoder_free(AstDecoder *dec)
+{
+    g_free(dec->planes);
+    dec->planes = NULL;
+    dec->width = 0;
+    dec->height = 0;
+}
+
+int ast_decoder_resize(AstDecoder *dec, int width, int height)
+{
+    size_t plane;
+
+    if (dec->planes != NULL && dec->width == width && dec->height == height) {
+        return 0;
+    }
+    ast_decoder_free(dec);
+    if (width <= 0 || height <= 0) {
+        return -1;
+    }
+
+    dec->stride = (width + PLANE_ALIGN - 1) & ~(PLANE_ALIGN - 1);
+    dec->rows = (height + PLANE_ALIGN - 1) & ~(PLANE_ALIGN - 1);
+    plane = (size_t)dec->stride * dec->rows;
+    dec->planes = g_try_malloc(plane * 3);
+    if (dec->planes == NULL) {
+        return -1;
+    }
+    /* black until the engine sends a full frame */
+    memset(dec->planes, 0, plane);
+    memset(dec->planes + plane, 128, plane * 2);
+    dec->width = width;
+    dec->height = height;
+    return 0;
+}
+
+/* write a decoded 8x8 block, upsampled by scale; pass 2 adds to what is there */
+static void store_block(uint8_t *dst, int stride, const int32_t *v, int scale, int add)
+{
+    int x, y, i, j;
+
+    for (y = 0; y < 8; y++) {
+        for (x = 0; x < 8; x++) {
+            for (i = 0; i < scale; i++) {
+                uint8_t *p = dst + (y * scale + i) * stride + x * scale;
+
+                for (j = 0; j < scale; j++) {
+                    int s = v[y * 8 + x] + (add ? p[j] : 128);
+
+                    p[j] = CLAMP(s, 0, 255);
+                }
+            }
+        }
+    }
+}
+
+static void store_vq(uint8_t *planes, size_t plane, int stride, const AstBlock *block,
+                     int scale)
+{
+    int x, y, i, j;
+
+    for (y = 0; y < 8; y++) {
+        for (x = 0; x < 8; x++) {
+            uint32_t c = block->vq_color[block->vq_index[y * 8 + x]];
+
+            for (i = 0; i < scale; i++) {
+                uint8_t *p = planes + (y * scale + i) * stride + x * scale;
+
+                for (j = 0; j < scale; j++) {
+                    p[j] = c >> 16;
+                    p[j + plane] = c >> 8;
+                    p[j + plane * 2] = c;
+                }
+            }
+        }
+    }
+}
+
+typedef struct DecodeCtx {
+    AstDecoder *dec;
+    int mb;
+} DecodeCtx;
+
+static void decode_block(const AstBlock *block, void *opaque)
+{
+    DecodeCtx *ctx = opaque;
+    AstDecoder *dec = ctx->dec;
+    size_t plane = (size_t)dec->stride * dec->rows;
+    int px = block->x * ctx->mb;
+    int py = block->y * ctx->mb;
+    uint8_t *y = dec->planes + (size_t)py * dec->stride + px;
+    void (*idct)(const int16_t *, const uint16_t *, int32_t *) =
+        dec->simd ? ast_idct_simd : ast_idct_scalar;
+    int32_t out[64];
+
+    if (block->kind == AST_BLOCK_KIND_VQ) {
+        store_vq(y, plane, dec->stride, block, ctx->mb / 8);
+    } else {
+        uint16_t (*quant)[64] = dec->quant[block->kind != AST_BLOCK_KIND_JPEG];
+        int add = block->kind == AST_BLOCK_KIND_JPEG_PASS2;
+        int nluma = block->ncomps - 2;
+        int i;
+
+        /* 4:2:0 luma blocks go top left, top right, bottom left, bottom right */
+        for (i = 0; i < nluma; i++) {
+            idct(block->coef[i], quant[0], out);
+            store_block(y + (i >> 1) * 8 * dec->stride + (i & 1) * 8, dec->stride,
+                        out, 1, add);
+        }
+        for (i = 0; i < 2; i++) {
+            idct(block->coef[nluma + i], quant[1], out);
+            store_block(y + plane * (i + 1), dec->stride, out, ctx->mb / 8, add);
+        }
+    }
+
+    dec->dirty.left = MIN(dec->dirty.left, px);
+    dec->dirty.top = MIN(dec->dirty.top, py);
+    dec->dirty.right = MAX(dec->dirty.right, px + ctx->mb);
+    dec->dirty.bottom = MAX(dec->dirty.bottom, py + ctx->mb);
+}
+
+int ast_decode_frame(AstDecoder *dec, const AstDecodeParams *params,
+                     const uint8_t *data, size_t size, AstDecodeRect *dirty)
+{
+    DecodeCtx ctx = { dec, ast_stream_mb_size(&params->info) };
+    int ret;
+
+    memset(dirty, 0, sizeof(*dirty));
+    if (!engine_quant_loaded || dec->planes == NULL ||
+        params->info.width != dec->width || params->info.height != dec->height) {
+        return -1;
+    }
+
+    update_quant(dec, params);
+    dec->dirty.left = dec->width;
+    dec->dirty.top = dec->height;
+    dec->dirty.right = 0;
+    dec->dirty.bottom = 0;
+
+    ret = ast_stream_walk(&params->info, data, size, decode_block, &ctx, NULL);
+
+    dec->dirty.right = MIN(dec->dirty.right, dec->width);
+    dec->dirty.bottom = MIN(dec->dirty.bottom, dec->height);
+    if (dec->dirty.right > dec->dirty.left && dec->dirty.bottom > dec->dirty.top) {
+        *dirty = dec->dirty;
+    }
+    return ret;
+}
+
+void ast_decode_rgb(AstDecoder *dec, const AstDecodeRect *rect,
+                    uint32_t *dst, int dst_stride)
+{
+    size_t plane = (size_t)dec->stride * dec->rows;
+    int n = rect->right - rect->left;
+    int row;
+
+    for (row = rect->top; row < rect->bottom; row++) {
+        const uint8_t *y = dec->planes + (size_t)row * dec->stride + rect->left;
+
+        if (dec->simd) {
+            ast_yuv_to_rgb_simd(y, y + plane, y + plane * 2, dst, n);
+        } else {
+            ast_yuv_to_rgb_scalar(y, y + plane, y + plane * 2, dst, n);
+        }
+        dst += dst_stride;
+    }
+}
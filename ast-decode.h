@@ -0,0 +1,89 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef __AST_DECODE_H__
+#define __AST_DECODE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ast-stream.h"
+
+/*
+ * Server side decoder for the AST2100+ video engine stream, for clients
+ * that can't take SPICE_IMAGE_TYPE_AST.
+ *
+ * The decoder keeps the engine's reference frame as full resolution Y, Cb
+ * and Cr planes: a frame only carries the macroblocks that changed, and
+ * pass 2 blocks refine the pixels already there. ast_decode_frame()
+ * applies a frame to the planes and returns the area it touched,
+ * ast_decode_rgb() converts an area to 32-bit xRGB.
+ *
+ * The IDCT and the color conversion come in a scalar and a vector
+ * version; the vector one uses GCC vector extensions, which map to
+ * SSE2/NEON where the target has them.
+ *
+ * A decoder is only ever used from one thread.
+ */
+
+typedef struct AstDecodeParams {
+    AstStreamInfo info;
+    int jpeg_table;         /* quant table of normal blocks, 0 (coarsest) - 11 */
+    int adv_table;          /* quant table of low quality and pass 2 blocks */
+} AstDecodeParams;
+
+typedef struct AstDecodeRect {
+    int left, top, right, bottom;
+} AstDecodeRect;
+
+typedef struct AstDecoder {
+    int simd;
+
+    int width, height;
+    int stride;             /* of the planes, padded to whole macroblocks */
+    int rows;
+    uint8_t *planes;        /* Y, Cb, Cr, stride * rows each */
+
+    int quant_tables[2];    /* jpeg_table, adv_table the quant tables were built for */
+    uint16_t quant[2][2][64]; /* [normal/adv][luma/chroma], natural order */
+
+    AstDecodeRect dirty;
+} AstDecoder;
+
+void ast_decoder_init(AstDecoder *dec, int simd);
+void ast_decoder_free(AstDecoder *dec);
+int ast_decoder_resize(AstDecoder *dec, int width, int height);
+
+/*
+ * Apply one frame to the reference planes. dirty receives the area
+ * touched by the frame, empty if it had no blocks. Returns 0 on success,
+ * -1 if the stream is malformed; the planes may be partly updated then.
+ */
+int ast_decode_frame(AstDecoder *dec, const AstDecodeParams *params,
+                     const uint8_t *data, size_t size, AstDecodeRect *dirty);
+
+/* convert rect of the reference planes to xRGB, dst_stride in pixels */
+void ast_decode_rgb(AstDecoder *dec, const AstDecodeRect *rect,
+                    uint32_t *dst, int dst_stride);
+
+#define AST_QUANT_TABLES 12
+
+/*
+ * Load the engine's quant tables, see ast-decode.c for the format; 0 on
+ * success. Nothing is decoded before they are loaded.
+ */
+int ast_quant_tables_load(const char *path);
+int ast_quant_tables_loaded(void);
+/* quant table of the engine's table index, natural order */
+void ast_quant_table(uint16_t *quant, int chroma, int table);
+
+/* kernels, exported for ast-decode-bench */
+
+/* dequantize and inverse transform one block, out is not level shifted */
+void ast_idct_scalar(const int16_t *coef, const uint16_t *quant, int32_t *out);
+void ast_idct_simd(const int16_t *coef, const uint16_t *quant, int32_t *out);
+
+void ast_yuv_to_rgb_scalar(const uint8_t *y, const uint8_t *cb, const uint8_t *cr,
+                           uint32_t *dst, int n);
+void ast_yuv_to_rgb_simd(const uint8_t *y, const uint8_t *cb, const uint8_t *cr,
+                         uint32_t *dst, int n);
+
+#endif /* __AST_DECODE_H__ */
@@ -0,0 +1,18 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef __AST_HASH_H__
+#define __AST_HASH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * 64-bit content hash of capture payloads, XXH64 compatible.
+ *
+ * The bulk loop runs four independent 64-bit lanes over 32 bytes at a
+ * time, which keeps the multipliers busy in parallel and hashes a frame
+ * at close to memory speed. Not suited for anything adversarial.
+ */
+
+uint64_t ast_hash64(const void *data, size_t size, uint64_t seed);
+
+#endif /* __AST_HASH_H__ */
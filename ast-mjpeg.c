@@ -0,0 +1,467 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <config.h>
+#include <string.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "ast-mjpeg.h"
+
+/* largest magnitude of a baseline coefficient */
+#define COEF_MAX 1023
+
+/* ---------- huffman encoding tables ---------- */
+
+typedef struct HuffEnc {
+    uint16_t code[256];
+    uint8_t size[256];
+} HuffEnc;
+
+static HuffEnc huff_enc[AST_HUFF_NTABLES];
+
+/* C(u) / 2 * cos((2x + 1) * u * pi / 16), for VQ blocks */
+static float dct_basis[8][8];
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void tables_init(void)
+{
+    /* cos(k * pi / 16) */
+    static const float cos16[9] = {
+        1.0f, 0.98078528f, 0.92387953f, 0.83146961f, 0.70710678f,
+        0.55557023f, 0.38268343f, 0.19509032f, 0.0f
+    };
+    int t, len, i, u, x;
+
+    for (t = 0; t < AST_HUFF_NTABLES; t++) {
+        const AstHuffSpec *spec = &ast_huff_specs[t];
+        int code = 0;
+        int k = 0;
+
+        for (len = 1; len <= 16; len++) {
+            for (i = 0; i < spec->bits[len]; i++, k++, code++) {
+                huff_enc[t].code[spec->vals[k]] = code;
+                huff_enc[t].size[spec->vals[k]] = len;
+            }
+            code <<= 1;
+        }
+    }
+
+    for (u = 0; u < 8; u++) {
+        for (x = 0; x < 8; x++) {
+            int m = ((2 * x + 1) * u) % 32;
+            float c;
+
+            if (m > 16) {
+                m = 32 - m;
+            }
+            c = m > 8 ? -cos16[16 - m] : cos16[m];
+            dct_basis[u][x] = (u ? 0.5f : 0.35355339f) * c;
+        }
+    }
+}
+
+/* ---------- coefficient cache ---------- */
+
+void ast_mjpeg_init(AstMjpeg *mjpeg)
+{
+    pthread_once(&tables_once, tables_init);
+    memset(mjpeg, 0, sizeof(*mjpeg));
+    mjpeg->jpeg_table = -1;
+    mjpeg->adv_table = -1;
+}
+
+void ast_mjpeg_free(AstMjpeg *mjpeg)
+{
+    g_free(mjpeg->coef);
+    g_free(mjpeg->seen);
+    g_free(mjpeg->out);
+    ast_mjpeg_init(mjpeg);
+}
+
+static int mjpeg_reset(AstMjpeg *mjpeg, const AstDecodeParams *params)
+{
+    int mb = ast_stream_mb_size(&params->info);
+    int n;
+
+    g_free(mjpeg->coef);
+    g_free(mjpeg->seen);
+    mjpeg->width = params->info.width;
+    mjpeg->height = params->info.height;
+    mjpeg->mode420 = params->info.mode420;
+    mjpeg->jpeg_table = params->jpeg_table;
+    mjpeg->mbw = (mjpeg->width + mb - 1) / mb;
+    mjpeg->mbh = (mjpeg->height + mb - 1) / mb;
+    mjpeg->ncomps = mjpeg->mode420 ? 6 : 3;
+    mjpeg->nseen = 0;
+    mjpeg->resets++;
+
+    n = mjpeg->mbw * mjpeg->mbh;
+    mjpeg->coef = g_try_malloc0_n(n, mjpeg->ncomps * 64 * sizeof(int16_t));
+    mjpeg->seen = g_try_malloc0(n);
+    if (mjpeg->coef == NULL || mjpeg->seen == NULL) {
+        g_free(mjpeg->coef);
+        g_free(mjpeg->seen);
+        mjpeg->coef = NULL;
+        mjpeg->seen = NULL;
+        mjpeg->width = 0;
+        return -1;
+    }
+    ast_quant_table(mjpeg->quant[0], FALSE, mjpeg->jpeg_table);
+    ast_quant_table(mjpeg->quant[1], TRUE, mjpeg->jpeg_table);
+    return 0;
+}
+
+static inline int16_t quantize(int32_t v, int q)
+{
+    v = v >= 0 ? (v + q / 2) / q : -((-v + q / 2) / q);
+    return CLAMP(v, -COEF_MAX, COEF_MAX);
+}
+
+/* coefficients quantized with the advanced table to the frame's table */
+static void requantize(AstMjpeg *mjpeg, int16_t *dst, const int16_t *src, int chroma, int add)
+{
+    const uint16_t *from = mjpeg->adv_quant[chroma];
+    const uint16_t *to = mjpeg->quant[chroma];
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        int32_t v = src[i] * from[i] + (add ? dst[i] * to[i] : 0);
+
+        dst[i] = quantize(v, to[i]);
+    }
+}
+
+/* pixels (level shifted) of one 8x8 block to quantized coefficients */
+static void fdct_quantize(const float *pixels, const uint16_t *quant, int16_t *dst)
+{
+    float tmp[8][8];
+    int u, v, x, y;
+
+    for (u = 0; u < 8; u++) {
+        for (y = 0; y < 8; y++) {
+            float s = 0;
+
+            for (x = 0; x < 8; x++) {
+                s += dct_basis[u][x] * pixels[y * 8 + x];
+            }
+            tmp[u][y] = s;
+        }
+    }
+    for (v = 0; v < 8; v++) {
+        for (u = 0; u < 8; u++) {
+            float s = 0;
+
+            for (y = 0; y < 8; y++) {
+                s += dct_basis[v][y] * tmp[u][y];
+            }
+            s /= quant[v * 8 + u];
+            dst[v * 8 + u] = CLAMP((int32_t)(s >= 0 ? s + 0.5f : s - 0.5f), -COEF_MAX, COEF_MAX);
+        }
+    }
+}
+
+/* a VQ block covers the whole macroblock, 2x upsampled in 4:2:0 */
+static void vq_to_coef(AstMjpeg *mjpeg, const AstBlock *block, int16_t *dst)
+{
+    int nluma = mjpeg->ncomps - 2;
+    int scale = mjpeg->mode420 ? 2 : 1;
+    float pixels[64];
+    int i, c, x, y;
+
+    for (i = 0; i < nluma; i++) {
+        for (y = 0; y < 8; y++) {
+            for (x = 0; x < 8; x++) {
+                int vx = ((i & 1) * 8 + x) / scale;
+                int vy = ((i >> 1) * 8 + y) / scale;
+                uint32_t color = block->vq_color[block->vq_index[vy * 8 + vx]];
+
+                pixels[y * 8 + x] = (float)((color >> 16) & 0xff) - 128;
+            }
+        }
+        fdct_quantize(pixels, mjpeg->quant[0], dst + i * 64);
+    }
+    for (c = 0; c < 2; c++) {
+        int shift = c ? 0 : 8;
+
+        for (i = 0; i < 64; i++) {
+            uint32_t color = block->vq_color[block->vq_index[i]];
+
+            pixels[i] = (float)((color >> shift) & 0xff) - 128;
+        }
+        fdct_quantize(pixels, mjpeg->quant[1], dst + (nluma + c) * 64);
+    }
+}
+
+static void mjpeg_block(const AstBlock *block, void *opaque)
+{
+    AstMjpeg *mjpeg = opaque;
+    int mb = block->y * mjpeg->mbw + block->x;
+    int16_t *dst = mjpeg->coef + (size_t)mb * mjpeg->ncomps * 64;
+    int nluma = mjpeg->ncomps - 2;
+    int i;
+
+    switch (block->kind) {
+    case AST_BLOCK_KIND_JPEG:
+        memcpy(dst, block->coef, mjpeg->ncomps * 64 * sizeof(int16_t));
+        break;
+    case AST_BLOCK_KIND_JPEG_LOW:
+    case AST_BLOCK_KIND_JPEG_PASS2:
+        for (i = 0; i < mjpeg->ncomps; i++) {
+            requantize(mjpeg, dst + i * 64, block->coef[i], i >= nluma,
+                       block->kind == AST_BLOCK_KIND_JPEG_PASS2);
+        }
+        if (block->kind == AST_BLOCK_KIND_JPEG_PASS2) {
+            /* refines what is there, a block first seen this way is not known */
+            return;
+        }
+        break;
+    case AST_BLOCK_KIND_VQ:
+        vq_to_coef(mjpeg, block, dst);
+        break;
+    }
+
+    if (!mjpeg->seen[mb]) {
+        mjpeg->seen[mb] = TRUE;
+        mjpeg->nseen++;
+    }
+}
+
+int ast_mjpeg_update(AstMjpeg *mjpeg, const AstDecodeParams *params,
+                     const uint8_t *data, size_t size)
+{
+    if (!ast_quant_tables_loaded()) {
+        return -1;
+    }
+    if (mjpeg->coef == NULL ||
+        params->info.width != mjpeg->width || params->info.height != mjpeg->height ||
+        params->info.mode420 != mjpeg->mode420 || params->jpeg_table != mjpeg->jpeg_table) {
+        if (mjpeg_reset(mjpeg, params) < 0) {
+            return -1;
+        }
+    }
+    if (params->adv_table != mjpeg->adv_table) {
+        ast_quant_table(mjpeg->adv_quant[0], FALSE, params->adv_table);
+        ast_quant_table(mjpeg->adv_quant[1], TRUE, params->adv_table);
+        mjpeg->adv_table = params->adv_table;
+    }
+
+    if (ast_stream_walk(&params->info, data, size, mjpeg_block, mjpeg, NULL) < 0) {
+        return -1;
+    }
+    return mjpeg->nseen == mjpeg->mbw * mjpeg->mbh;
+}
+
+void ast_mjpeg_invalidate(AstMjpeg *mjpeg)
+{
+    if (mjpeg->seen != NULL) {
+        memset(mjpeg->seen, 0, mjpeg->mbw * mjpeg->mbh);
+    }
+    mjpeg->nseen = 0;
+}
+
+/* ---------- JFIF writer ---------- */
+
+typedef struct BitWriter {
+    uint8_t *p;
+    uint8_t *end;
+    uint32_t acc;
+    int bits;
+    int overflow;
+} BitWriter;
+
+static inline void bw_byte(BitWriter *bw, uint8_t b)
+{
+    if (bw->p >= bw->end) {
+        bw->overflow = TRUE;
+        return;
+    }
+    *bw->p++ = b;
+}
+
+static void bw_bytes(BitWriter *bw, const uint8_t *data, size_t len)
+{
+    if (bw->p + len > bw->end) {
+        bw->overflow = TRUE;
+        return;
+    }
+    memcpy(bw->p, data, len);
+    bw->p += len;
+}
+
+/* size <= 16, entropy coded bytes get 0xff stuffed */
+static inline void bw_put(BitWriter *bw, uint32_t code, int size)
+{
+    bw->acc = (bw->acc << size) | (code & ((1u << size) - 1));
+    bw->bits += size;
+    while (bw->bits >= 8) {
+        uint8_t b = bw->acc >> (bw->bits - 8);
+
+        bw_byte(bw, b);
+        if (b == 0xff) {
+            bw_byte(bw, 0);
+        }
+        bw->bits -= 8;
+    }
+}
+
+static void bw_flush(BitWriter *bw)
+{
+    if (bw->bits > 0) {
+        bw_put(bw, 0x7f, 8 - bw->bits);
+    }
+}
+
+static inline int bit_length(int v)
+{
+    return v ? 32 - __builtin_clz(v) : 0;
+}
+
+static void encode_block(BitWriter *bw, const int16_t *coef, int *dc_pred,
+                         const HuffEnc *dc, const HuffEnc *ac)
+{
+    int diff = coef[0] - *dc_pred;
+    int run = 0;
+    int n, k;
+
+    *dc_pred = coef[0];
+    n = bit_length(ABS(diff));
+    bw_put(bw, dc->code[n], dc->size[n]);
+    if (n) {
+        bw_put(bw, diff < 0 ? diff - 1 : diff, n);
+    }
+
+    for (k = 1; k < 64; k++) {
+        int v = coef[ast_natural_order[k]];
+
+        if (v == 0) {
+            run++;
+            continue;
+        }
+        while (run > 15) {
+            bw_put(bw, ac->code[0xf0], ac->size[0xf0]);
+            run -= 16;
+        }
+        n = bit_length(ABS(v));
+        bw_put(bw, ac->code[(run << 4) | n], ac->size[(run << 4) | n]);
+        bw_put(bw, v < 0 ? v - 1 : v, n);
+        run = 0;
+    }
+    if (run) {
+        bw_put(bw, ac->code[0x00], ac->size[0x00]);
+    }
+}
+
+static void write_marker(BitWriter *bw, uint8_t marker, int len)
+{
+    uint8_t hdr[4] = { 0xff, marker, len >> 8, len & 0xff };
+
+    bw_bytes(bw, hdr, len ? 4 : 2);
+}
+
+static void write_headers(AstMjpeg *mjpeg, BitWriter *bw)
+{
+    static const uint8_t jfif[] = {
+        'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0
+    };
+    static const uint8_t dht_class[AST_HUFF_NTABLES] = {
+        [AST_HUFF_DC_LUMINANCE] = 0x00,
+        [AST_HUFF_DC_CHROMINANCE] = 0x01,
+        [AST_HUFF_AC_LUMINANCE] = 0x10,
+        [AST_HUFF_AC_CHROMINANCE] = 0x11,
+    };
+    uint8_t buf[2 + 2 * 65];
+    int dht_len = 2;
+    int t, i;
+
+    write_marker(bw, 0xd8, 0);                  /* SOI */
+    write_marker(bw, 0xe0, 2 + sizeof(jfif));   /* APP0 */
+    bw_bytes(bw, jfif, sizeof(jfif));
+
+    write_marker(bw, 0xdb, 2 + 2 * 65);         /* DQT, zigzag order */
+    for (t = 0; t < 2; t++) {
+        buf[t * 65] = t;
+        for (i = 0; i < 64; i++) {
+            buf[t * 65 + 1 + i] = mjpeg->quant[t][ast_natural_order[i]];
+        }
+    }
+    bw_bytes(bw, buf, 2 * 65);
+
+    write_marker(bw, 0xc0, 17);                 /* SOF0 */
+    buf[0] = 8;
+    buf[1] = mjpeg->height >> 8;
+    buf[2] = mjpeg->height & 0xff;
+    buf[3] = mjpeg->width >> 8;
+    buf[4] = mjpeg->width & 0xff;
+    buf[5] = 3;
+    buf[6] = 1; buf[7] = mjpeg->mode420 ? 0x22 : 0x11; buf[8] = 0;
+    buf[9] = 2; buf[10] = 0x11; buf[11] = 1;
+    buf[12] = 3; buf[13] = 0x11; buf[14] = 1;
+    bw_bytes(bw, buf, 15);
+
+    for (t = 0; t < AST_HUFF_NTABLES; t++) {
+        dht_len += 17 + ast_huff_specs[t].nvals;
+    }
+    write_marker(bw, 0xc4, dht_len);            /* DHT */
+    for (t = 0; t < AST_HUFF_NTABLES; t++) {
+        bw_byte(bw, dht_class[t]);
+        bw_bytes(bw, ast_huff_specs[t].bits + 1, 16);
+        bw_bytes(bw, ast_huff_specs[t].vals, ast_huff_specs[t].nvals);
+    }
+
+    write_marker(bw, 0xda, 12);                 /* SOS */
+    buf[0] = 3;
+    buf[1] = 1; buf[2] = 0x00;
+    buf[3] = 2; buf[4] = 0x11;
+    buf[5] = 3; buf[6] = 0x11;
+    buf[7] = 0; buf[8] = 63; buf[9] = 0;
+    bw_bytes(bw, buf, 10);
+}
+
+static int mjpeg_write(AstMjpeg *mjpeg, BitWriter *bw)
+{
+    int nluma = mjpeg->ncomps - 2;
+    int dc_pred[3] = { 0, 0, 0 };
+    const int16_t *coef = mjpeg->coef;
+    int mb, i;
+
+    write_headers(mjpeg, bw);
+    for (mb = 0; mb < mjpeg->mbw * mjpeg->mbh && !bw->overflow; mb++) {
+        for (i = 0; i < nluma; i++, coef += 64) {
+            encode_block(bw, coef, &dc_pred[0], &huff_enc[AST_HUFF_DC_LUMINANCE],
+                         &huff_enc[AST_HUFF_AC_LUMINANCE]);
+        }
+        for (i = 0; i < 2; i++, coef += 64) {
+            encode_block(bw, coef, &dc_pred[1 + i], &huff_enc[AST_HUFF_DC_CHROMINANCE],
+                         &huff_enc[AST_HUFF_AC_CHROMINANCE]);
+        }
+    }
+    bw_flush(bw);
+    write_marker(bw, 0xd9, 0);                  /* EOI */
+    return bw->overflow ? -1 : 0;
+}
+
+size_t ast_mjpeg_encode(AstMjpeg *mjpeg, const uint8_t **jpeg)
+{
+    BitWriter bw;
+
+    if (mjpeg->coef == NULL) {
+        return 0;
+    }
+    if (mjpeg->out == NULL) {
+        /* a couple of bits per coefficient is plenty for screen content */
+        mjpeg->out_size = (size_t)mjpeg->mbw * mjpeg->mbh * mjpeg->ncomps * 16 + 1024;
+        mjpeg->out = g_malloc(mjpeg->out_size);
+    }
+    for (;;) {
+        memset(&bw, 0, sizeof(bw));
+        bw.p = mjpeg->out;
+        bw.end = mjpeg->out + mjpeg->out_size;
+        if (mjpeg_write(mjpeg, &bw) == 0) {
+            break;
+        }
+        mjpeg->out_size *= 2;
+        mjpeg->out = g_realloc(mjpeg->out, mjpeg->out_size);
+    }
+    *jpeg = mjpeg->out;
+    return bw.p - mjpeg->out;
+}
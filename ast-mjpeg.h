@@ -0,0 +1,59 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef __AST_MJPEG_H__
+#define __AST_MJPEG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ast-decode.h"
+
+/*
+ * Rewraps the engine's stream as baseline JPEG, for spice's MJPEG stream
+ * channel, without going through pixels.
+ *
+ * The engine's JPEG blocks are already quantized DCT coefficients coded
+ * with the standard huffman tables, so they are kept as they are in a
+ * per-macroblock cache and only entropy coded again with JFIF framing.
+ * The cache turns the engine's partial frames into full ones. Low quality
+ * and pass 2 blocks are requantized to the frame's quant table; VQ
+ * blocks, which have no DCT form, are the only ones transformed.
+ *
+ * Used from the capture side only.
+ */
+
+typedef struct AstMjpeg {
+    int width, height;
+    int mode420;
+    int jpeg_table;
+    int adv_table;
+    int mbw, mbh;
+    int ncomps;             /* blocks per macroblock */
+    int16_t *coef;          /* quantized with jpeg_table, natural order */
+    uint8_t *seen;          /* macroblock coded since the last reset */
+    int nseen;
+    uint16_t quant[2][64];  /* jpeg_table, luma and chroma */
+    uint16_t adv_quant[2][64];
+    int resets;
+
+    uint8_t *out;
+    size_t out_size;
+} AstMjpeg;
+
+void ast_mjpeg_init(AstMjpeg *mjpeg);
+void ast_mjpeg_free(AstMjpeg *mjpeg);
+
+/*
+ * Apply a frame to the cache. A new size, subsampling or quant table
+ * starts over with an empty cache. Returns 1 once every macroblock is
+ * known, 0 before that and -1 if the stream is malformed.
+ */
+int ast_mjpeg_update(AstMjpeg *mjpeg, const AstDecodeParams *params,
+                     const uint8_t *data, size_t size);
+
+/* forget every macroblock, the next complete picture needs a full frame */
+void ast_mjpeg_invalidate(AstMjpeg *mjpeg);
+
+/* encode the cache as a JFIF image, valid until the next call; 0 on failure */
+size_t ast_mjpeg_encode(AstMjpeg *mjpeg, const uint8_t **jpeg);
+
+#endif /* __AST_MJPEG_H__ */
@@ -0,0 +1,95 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <config.h>
+#include <stdio.h>
+
+#include "ast-pacing.h"
+
+/* changes smaller than this (clock ticks, blinking carets) speed up gently */
+#define AST_PACING_SMALL_FRAME 4096
+
+/* exponential moving average with a weight of 1/8 for the new sample */
+#define EWMA(avg, sample) ((avg) + ((sample) - (avg)) / 8)
+
+void ast_pacing_init(AstPacing *pacing, int min_fps, int max_fps)
+{
+    min_fps = MAX(min_fps, 1);
+    max_fps = MAX(max_fps, min_fps);
+
+    pacing->min_interval_ms = 1000 / max_fps;
+    pacing->max_interval_ms = 1000 / min_fps;
+    pacing->interval_ms = pacing->max_interval_ms;
+    pacing->change_ratio = 0;
+    pacing->frame_bytes = 0;
+    pacing->release_us = 0;
+}
+
+/* the fastest rate the worker is currently able to drain */
+static int ast_pacing_floor(AstPacing *pacing)
+{
+    int release_ms = __atomic_load_n(&pacing->release_us, __ATOMIC_RELAXED) / 1000;
+
+    return CLAMP(release_ms, pacing->min_interval_ms, pacing->max_interval_ms);
+}
+
+void ast_pacing_capture(AstPacing *pacing, int changed, uint32_t size)
+{
+    int interval = pacing->interval_ms;
+
+    __atomic_store_n(&pacing->change_ratio, EWMA(pacing->change_ratio, changed ? 1000 : 0),
+                     __ATOMIC_RELAXED);
+    if (changed) {
+        __atomic_store_n(&pacing->frame_bytes, EWMA(pacing->frame_bytes, (int)size),
+                         __ATOMIC_RELAXED);
+        if (size < AST_PACING_SMALL_FRAME) {
+            interval = interval * 3 / 4;
+        } else {
+            interval = interval / 2;
+        }
+    } else {
+        interval += MAX(interval / 8, 1);
+    }
+    __atomic_store_n(&pacing->interval_ms,
+                     CLAMP(interval, ast_pacing_floor(pacing), pacing->max_interval_ms),
+                     __ATOMIC_RELAXED);
+}
+
+void ast_pacing_release(AstPacing *pacing, gint64 latency_us)
+{
+    int release_us = __atomic_load_n(&pacing->release_us, __ATOMIC_RELAXED);
+
+    latency_us = MIN(latency_us, G_USEC_PER_SEC);
+    __atomic_store_n(&pacing->release_us, EWMA(release_us, (int)latency_us),
+                     __ATOMIC_RELAXED);
+}
+
+/* nothing worth capturing right now (blank screen), drop to the idle rate */
+void ast_pacing_idle(AstPacing *pacing)
+{
+    __atomic_store_n(&pacing->change_ratio, EWMA(pacing->change_ratio, 0), __ATOMIC_RELAXED);
+    __atomic_store_n(&pacing->interval_ms, pacing->max_interval_ms, __ATOMIC_RELAXED);
+}
+
+/* also read by the worker, whose notifications rearm the timer in timer mode */
+int ast_pacing_interval(AstPacing *pacing)
+{
+    return __atomic_load_n(&pacing->interval_ms, __ATOMIC_RELAXED);
+}
+
+/* frames signalled by the driver are not fetched faster than this */
+int ast_pacing_min_interval(AstPacing *pacing)
+{
+    return ast_pacing_floor(pacing);
+}
+
+/* main loop, the capture side keeps updating the fields it reads */
+void ast_pacing_print(AstPacing *pacing)
+{
+    int interval = __atomic_load_n(&pacing->interval_ms, __ATOMIC_RELAXED);
+
+    printf("pacing: %.1f fps (%d ms, range %d-%d ms), change ratio %.2f,"
+           " frame %d bytes, release %.1f ms\n",
+           1000.0 / interval, interval, pacing->min_interval_ms, pacing->max_interval_ms,
+           __atomic_load_n(&pacing->change_ratio, __ATOMIC_RELAXED) / 1000.0,
+           __atomic_load_n(&pacing->frame_bytes, __ATOMIC_RELAXED),
+           __atomic_load_n(&pacing->release_us, __ATOMIC_RELAXED) / 1000.0);
+}
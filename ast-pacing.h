@@ -0,0 +1,45 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef __AST_PACING_H__
+#define __AST_PACING_H__
+
+#include <stdint.h>
+#include <glib.h>
+
+/*
+ * Frame pacing governor.
+ *
+ * Picks the interval between two GET_VIDEO calls: it halves the interval
+ * whenever the engine reports a change and backs off slowly towards the
+ * idle rate while the screen is static. The interval never drops below
+ * what the worker needs to release a frame, so capture does not outrun
+ * the clients.
+ *
+ * ast_pacing_capture() and ast_pacing_interval() are called from the
+ * capture side, ast_pacing_release() from the red_worker thread and
+ * ast_pacing_print() from the main loop. Fields another thread reads are
+ * stored with relaxed atomics.
+ */
+
+#define AST_PACING_MIN_FPS_DEFAULT 5
+#define AST_PACING_MAX_FPS_DEFAULT 30
+
+typedef struct AstPacing {
+    int min_interval_ms;    /* 1000 / max fps */
+    int max_interval_ms;    /* 1000 / min fps */
+    int interval_ms;        /* current capture interval */
+
+    /* moving averages, fixed point x1000 where noted */
+    int change_ratio;       /* share of GET_VIDEO calls that saw a change, x1000 */
+    int frame_bytes;        /* compressed size of changed frames */
+    int release_us;         /* queue to release latency, written by the worker */
+} AstPacing;
+
+void ast_pacing_init(AstPacing *pacing, int min_fps, int max_fps);
+void ast_pacing_capture(AstPacing *pacing, int changed, uint32_t size);
+void ast_pacing_release(AstPacing *pacing, gint64 latency_us);
+void ast_pacing_idle(AstPacing *pacing);
+int ast_pacing_interval(AstPacing *pacing);
+int ast_pacing_min_interval(AstPacing *pacing);
+void ast_pacing_print(AstPacing *pacing);
+
+#endif /* __AST_PACING_H__ */
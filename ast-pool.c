@@ -0,0 +1,181 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <glib.h>
+
+#include "ast-pool.h"
+
+int ast_pool_init(AstPool *pool, const char *name, size_t size, int count,
+                  int prealloc)
+{
+    int i;
+
+    pool->name = name;
+    pool->size = size;
+    pool->count = CLAMP(count, 1, AST_POOL_MAX);
+    pool->free_mask = pool->count == 64 ? ~0ULL : (1ULL << pool->count) - 1;
+    pool->in_use = 0;
+    pool->high_water = 0;
+    pool->failures = 0;
+    for (i = 0; i < AST_POOL_MAX; i++) {
+        pool->objs[i] = NULL;
+    }
+    if (!prealloc) {
+        return TRUE;
+    }
+    for (i = 0; i < pool->count; i++) {
+        pool->objs[i] = calloc(1, size);
+        if (pool->objs[i] == NULL) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+void *ast_pool_get(AstPool *pool)
+{
+    uint64_t mask = __atomic_load_n(&pool->free_mask, __ATOMIC_ACQUIRE);
+    int in_use, high_water;
+    int i;
+
+    do {
+        if (mask == 0) {
+            __atomic_add_fetch(&pool->failures, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        i = __builtin_ctzll(mask);
+    } while (!__atomic_compare_exchange_n(&pool->free_mask, &mask, mask & ~(1ULL << i),
+                                          TRUE, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    /* index i is ours now, only this thread may touch objs[i] */
+    if (pool->objs[i] == NULL) {
+        __atomic_store_n(&pool->objs[i], malloc(pool->size), __ATOMIC_RELEASE);
+        if (pool->objs[i] == NULL) {
+            __atomic_or_fetch(&pool->free_mask, 1ULL << i, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&pool->failures, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+
+    in_use = __atomic_add_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+    high_water = __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED);
+    while (in_use > high_water &&
+           !__atomic_compare_exchange_n(&pool->high_water, &high_water, in_use,
+                                        TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return pool->objs[i];
+}
+
+static int ast_pool_index(AstPool *pool, void *obj)
+{
+    int i;
+
+    for (i = 0; i < pool->count; i++) {
+        if (__atomic_load_n(&pool->objs[i], __ATOMIC_RELAXED) == obj) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int ast_pool_owns(AstPool *pool, void *obj)
+{
+    return obj != NULL && ast_pool_index(pool, obj) >= 0;
+}
+
+void ast_pool_put(AstPool *pool, void *obj)
+{
+    int i = ast_pool_index(pool, obj);
+
+    if (obj == NULL || i < 0) {
+        return;
+    }
+    __atomic_sub_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+    __atomic_or_fetch(&pool->free_mask, 1ULL << i, __ATOMIC_RELEASE);
+}
+
+void ast_pool_print(AstPool *pool)
+{
+    printf("pool %s: %zu bytes x %d, in use %d, high water %d, exhausted %" PRIu64 "\n",
+           pool->name, pool->size, pool->count,
+           __atomic_load_n(&pool->in_use, __ATOMIC_RELAXED),
+           __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED),
+           __atomic_load_n(&pool->failures, __ATOMIC_RELAXED));
+}
+
+int ast_buf_pool_init(AstBufPool *bufs, const char *name, size_t max_size, int count)
+{
+    /* each class is a quarter of the next one, the largest fits anything */
+    size_t size = max_size;
+    int i;
+
+    for (i = AST_BUF_POOL_CLASSES - 1; i >= 0; i--) {
+        if (!ast_pool_init(&bufs->classes[i], name, size, count, FALSE)) {
+            return FALSE;
+        }
+        size /= 4;
+    }
+    return TRUE;
+}
+
+/* allocate and touch count buffers for size up front, so the first frames don't page fault */
+void ast_buf_pool_prefault(AstBufPool *bufs, size_t size, int count)
+{
+    void *bufs_held[AST_POOL_MAX];
+    int n = 0;
+    int i;
+
+    count = CLAMP(count, 0, AST_POOL_MAX);
+    while (n < count && (bufs_held[n] = ast_buf_pool_get(bufs, size)) != NULL) {
+        memset(bufs_held[n], 0, size);
+        n++;
+    }
+    while (n > 0) {
+        ast_buf_pool_put(bufs, bufs_held[--n]);
+    }
+    /* not real use */
+    for (i = 0; i < AST_BUF_POOL_CLASSES; i++) {
+        bufs->classes[i].high_water = 0;
+    }
+}
+
+void *ast_buf_pool_get(AstBufPool *bufs, size_t size)
+{
+    void *buf;
+    int i;
+
+    for (i = 0; i < AST_BUF_POOL_CLASSES; i++) {
+        if (bufs->classes[i].size < size) {
+            continue;
+        }
+        buf = ast_pool_get(&bufs->classes[i]);
+        if (buf != NULL) {
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+void ast_buf_pool_put(AstBufPool *bufs, void *buf)
+{
+    int i;
+
+    for (i = 0; i < AST_BUF_POOL_CLASSES; i++) {
+        if (ast_pool_owns(&bufs->classes[i], buf)) {
+            ast_pool_put(&bufs->classes[i], buf);
+            return;
+        }
+    }
+}
+
+void ast_buf_pool_print(AstBufPool *bufs)
+{
+    int i;
+
+    for (i = 0; i < AST_BUF_POOL_CLASSES; i++) {
+        ast_pool_print(&bufs->classes[i]);
+    }
+}
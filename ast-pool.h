@@ -0,0 +1,56 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef __AST_POOL_H__
+#define __AST_POOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Fixed-size object pools.
+ *
+ * A pool hands out up to AST_POOL_MAX objects of one size. Objects are
+ * allocated the first time their index is used (or all at init time)
+ * and are never freed, so a warmed up pool does no heap allocation.
+ * Free objects are tracked in a bitmask updated with compare-and-swap,
+ * so get and put may be called from different threads.
+ */
+
+#define AST_POOL_MAX 64
+
+typedef struct AstPool {
+    const char *name;
+    size_t size;
+    int count;
+    uint64_t free_mask;     /* bit set: object available */
+    void *objs[AST_POOL_MAX];
+
+    int in_use;
+    int high_water;
+    uint64_t failures;      /* get() found the pool exhausted */
+} AstPool;
+
+int ast_pool_init(AstPool *pool, const char *name, size_t size, int count,
+                  int prealloc);
+void *ast_pool_get(AstPool *pool);
+void ast_pool_put(AstPool *pool, void *obj);
+int ast_pool_owns(AstPool *pool, void *obj);
+void ast_pool_print(AstPool *pool);
+
+/*
+ * Size-classed buffers on top of AstPool: a request is served from the
+ * smallest class that fits, falling back to larger ones when it is used up.
+ */
+
+#define AST_BUF_POOL_CLASSES 4
+
+typedef struct AstBufPool {
+    AstPool classes[AST_BUF_POOL_CLASSES];
+} AstBufPool;
+
+int ast_buf_pool_init(AstBufPool *bufs, const char *name, size_t max_size, int count);
+void *ast_buf_pool_get(AstBufPool *bufs, size_t size);
+void ast_buf_pool_put(AstBufPool *bufs, void *buf);
+void ast_buf_pool_prefault(AstBufPool *bufs, size_t size, int count);
+void ast_buf_pool_print(AstBufPool *bufs);
+
+#endif /* __AST_POOL_H__ */
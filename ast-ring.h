@@ -0,0 +1,67 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef __AST_RING_H__
+#define __AST_RING_H__
+
+#include <stdint.h>
+
+/*
+ * Lock-free single-producer/single-consumer ring of pointers.
+ *
+ * head is only written by the producer and tail only by the consumer;
+ * each side publishes its index with release semantics and reads the
+ * other one with acquire semantics, so an entry is fully written before
+ * the consumer can see it and fully read before the producer reuses it.
+ */
+
+#define AST_RING_SIZE 16 /* power of two */
+#define AST_RING_CACHELINE 64
+
+typedef struct AstRing {
+    uint32_t head __attribute__((aligned(AST_RING_CACHELINE)));
+    uint32_t tail __attribute__((aligned(AST_RING_CACHELINE)));
+    void *entries[AST_RING_SIZE] __attribute__((aligned(AST_RING_CACHELINE)));
+} AstRing;
+
+static inline void ast_ring_init(AstRing *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+/* number of queued entries, exact from either side for its own index */
+static inline uint32_t ast_ring_count(AstRing *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/* producer side, returns 0 if the ring is full */
+static inline int ast_ring_push(AstRing *ring, void *entry)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail >= AST_RING_SIZE) {
+        return 0;
+    }
+    ring->entries[head & (AST_RING_SIZE - 1)] = entry;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* consumer side, returns NULL if the ring is empty */
+static inline void *ast_ring_pop(AstRing *ring)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    void *entry;
+
+    if (tail == head) {
+        return NULL;
+    }
+    entry = ring->entries[tail & (AST_RING_SIZE - 1)];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return entry;
+}
+
+#endif /* __AST_RING_H__ */
@@ -0,0 +1,128 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#define _GNU_SOURCE
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "ast-sched.h"
+
+static int parse_int(const char *s, int *value)
+{
+    char *end;
+    long v;
+
+    errno = 0;
+    v = strtol(s, &end, 10);
+    if (errno || end == s || *end != '\0' || v < 0 || v > 1000) {
+        return -1;
+    }
+    *value = v;
+    return 0;
+}
+
+int ast_sched_parse(AstSched *sched, const char *spec)
+{
+    gchar **items = g_strsplit(spec, ",", -1);
+    int ret = 0;
+    int i, value;
+
+    for (i = 0; items[i] != NULL && ret == 0; i++) {
+        const char *item = items[i];
+
+        if (g_str_has_prefix(item, "cpu=")) {
+            if (parse_int(item + 4, &value) < 0 || value >= AST_SCHED_CPUS_MAX) {
+                ret = -1;
+            } else {
+                sched->cpus |= 1u << value;
+            }
+        } else if (g_str_has_prefix(item, "fifo=") || g_str_has_prefix(item, "rr=")) {
+            int fifo = item[0] == 'f';
+
+            if (parse_int(strchr(item, '=') + 1, &value) < 0 ||
+                value < sched_get_priority_min(fifo ? SCHED_FIFO : SCHED_RR) ||
+                value > sched_get_priority_max(fifo ? SCHED_FIFO : SCHED_RR)) {
+                ret = -1;
+            } else {
+                sched->policy = fifo ? SCHED_FIFO : SCHED_RR;
+                sched->priority = value;
+            }
+        } else if (strcmp(item, "other") == 0) {
+            sched->policy = SCHED_OTHER;
+            sched->priority = 0;
+        } else if (item[0] != '\0') {
+            ret = -1;
+        }
+    }
+    g_strfreev(items);
+    return ret;
+}
+
+void ast_sched_apply(const AstSched *sched, const char *name)
+{
+    pthread_t self = pthread_self();
+    int err;
+
+    if (sched->cpus) {
+        cpu_set_t set;
+        int cpu;
+
+        CPU_ZERO(&set);
+        for (cpu = 0; cpu < AST_SCHED_CPUS_MAX; cpu++) {
+            if (sched->cpus & (1u << cpu)) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        err = pthread_setaffinity_np(self, sizeof(set), &set);
+        if (err) {
+            printf("%s: %s: setting the CPU affinity failed: %s\n", __func__, name,
+                   strerror(err));
+        }
+    }
+    if (sched->policy >= 0) {
+        struct sched_param param = { .sched_priority = sched->priority };
+
+        err = pthread_setschedparam(self, sched->policy, &param);
+        if (err) {
+            printf("%s: %s: setting the scheduling policy failed: %s\n", __func__, name,
+                   strerror(err));
+        }
+    }
+    if (sched->cpus || sched->policy >= 0) {
+        printf("%s: %s: cpus 0x%x, %s priority %d\n", __func__, name, sched->cpus,
+               sched->policy == SCHED_FIFO ? "fifo" :
+               sched->policy == SCHED_RR ? "rr" : "other", sched->priority);
+    }
+}
+
+void ast_deadline_init(AstDeadline *deadline, const char *name)
+{
+    memset(deadline, 0, sizeof(*deadline));
+    deadline->name = name;
+}
+
+void ast_deadline_check(AstDeadline *deadline, gint64 due, gint64 now)
+{
+    gint64 late = now - due;
+
+    /* the stats timer reads these and starts late_max_us over */
+    __atomic_add_fetch(&deadline->checks, 1, __ATOMIC_RELAXED);
+    if (late > AST_DEADLINE_SLACK_US) {
+        __atomic_add_fetch(&deadline->missed, 1, __ATOMIC_RELAXED);
+    }
+    if (late > __atomic_load_n(&deadline->late_max_us, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&deadline->late_max_us, late, __ATOMIC_RELAXED);
+    }
+}
+
+void ast_deadline_print(AstDeadline *deadline)
+{
+    printf("deadline %s: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+           " missed, worst %.1f ms late\n",
+           deadline->name, __atomic_load_n(&deadline->missed, __ATOMIC_RELAXED),
+           __atomic_load_n(&deadline->checks, __ATOMIC_RELAXED),
+           __atomic_exchange_n(&deadline->late_max_us, 0, __ATOMIC_RELAXED) / 1000.0);
+}
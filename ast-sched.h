@@ -0,0 +1,47 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef __AST_SCHED_H__
+#define __AST_SCHED_H__
+
+#include <stdint.h>
+#include <glib.h>
+
+/*
+ * CPU placement and scheduling of the threads on the console path, so
+ * the BMC's other daemons can't starve them.
+ *
+ * A spec is a comma separated list of cpu=N (repeat for several CPUs),
+ * fifo=PRIO, rr=PRIO or other, e.g. "cpu=1,fifo=40". Settings are applied
+ * by the thread they are meant for, to itself.
+ *
+ * AstDeadline counts how often a context ran later than it was due.
+ * Checked by the owning thread, printed from the main loop; both go
+ * through relaxed atomics.
+ */
+
+#define AST_SCHED_CPUS_MAX 32
+
+/* how late a context may run before it counts as a missed deadline */
+#define AST_DEADLINE_SLACK_US 10000
+
+typedef struct AstSched {
+    uint32_t cpus;          /* affinity mask, 0: leave as is */
+    int policy;             /* SCHED_OTHER, SCHED_FIFO or SCHED_RR, -1: leave as is */
+    int priority;
+} AstSched;
+
+typedef struct AstDeadline {
+    const char *name;
+    uint64_t checks;
+    uint64_t missed;
+    gint64 late_max_us;
+} AstDeadline;
+
+int ast_sched_parse(AstSched *sched, const char *spec);
+/* apply to the calling thread, name is for the log */
+void ast_sched_apply(const AstSched *sched, const char *name);
+
+void ast_deadline_init(AstDeadline *deadline, const char *name);
+void ast_deadline_check(AstDeadline *deadline, gint64 due, gint64 now);
+void ast_deadline_print(AstDeadline *deadline);
+
+#endif /* __AST_SCHED_H__ */
@@ -0,0 +1,418 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <config.h>
+#include <string.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "ast-stream.h"
+
+/* ---------- standard huffman tables, JPEG Annex K.3 ---------- */
+
+static const uint8_t std_dc_luminance_bits[17] = {
+    0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0
+};
+static const uint8_t std_dc_luminance_vals[] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+static const uint8_t std_dc_chrominance_bits[17] = {
+    0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0
+};
+static const uint8_t std_dc_chrominance_vals[] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+static const uint8_t std_ac_luminance_bits[17] = {
+    0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d
+};
+static const uint8_t std_ac_luminance_vals[] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+    0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+    0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+    0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+    0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+    0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+    0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+    0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+static const uint8_t std_ac_chrominance_bits[17] = {
+    0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77
+};
+static const uint8_t std_ac_chrominance_vals[] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+    0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+    0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+    0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+    0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+    0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+    0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+const AstHuffSpec ast_huff_specs[AST_HUFF_NTABLES] = {
+    [AST_HUFF_DC_LUMINANCE] = {
+        std_dc_luminance_bits, std_dc_luminance_vals, sizeof(std_dc_luminance_vals)
+    },
+    [AST_HUFF_DC_CHROMINANCE] = {
+        std_dc_chrominance_bits, std_dc_chrominance_vals, sizeof(std_dc_chrominance_vals)
+    },
+    [AST_HUFF_AC_LUMINANCE] = {
+        std_ac_luminance_bits, std_ac_luminance_vals, sizeof(std_ac_luminance_vals)
+    },
+    [AST_HUFF_AC_CHROMINANCE] = {
+        std_ac_chrominance_bits, std_ac_chrominance_vals, sizeof(std_ac_chrominance_vals)
+    },
+};
+
+const uint8_t ast_natural_order[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/* ---------- huffman decoding ---------- */
+
+#define HUFF_LOOKAHEAD 9
+
+typedef struct HuffTable {
+    uint8_t look_len[1 << HUFF_LOOKAHEAD];  /* 0: code is longer */
+    uint8_t look_val[1 << HUFF_LOOKAHEAD];
+    int32_t maxcode[18];                    /* largest code of each length, -1 if none */
+    int32_t valoffset[17];
+    uint8_t vals[256];
+} HuffTable;
+
+static HuffTable huff_tables[AST_HUFF_NTABLES];
+static pthread_once_t huff_once = PTHREAD_ONCE_INIT;
+
+static void huff_build(HuffTable *t, const uint8_t *bits, const uint8_t *vals, int nvals)
+{
+    int code = 0;
+    int k = 0;
+    int len, i;
+
+    memset(t, 0, sizeof(*t));
+    memcpy(t->vals, vals, nvals);
+    for (len = 1; len <= 16; len++) {
+        t->valoffset[len] = k - code;
+        for (i = 0; i < bits[len]; i++, k++, code++) {
+            if (len <= HUFF_LOOKAHEAD) {
+                int shift = HUFF_LOOKAHEAD - len;
+                int j;
+
+                for (j = 0; j < (1 << shift); j++) {
+                    t->look_len[(code << shift) | j] = len;
+                    t->look_val[(code << shift) | j] = vals[k];
+                }
+            }
+        }
+        t->maxcode[len] = bits[len] ? code - 1 : -1;
+        code <<= 1;
+    }
+    t->maxcode[17] = 0x7fffffff;
+}
+
+static void huff_init(void)
+{
+    int i;
+
+    for (i = 0; i < AST_HUFF_NTABLES; i++) {
+        huff_build(&huff_tables[i], ast_huff_specs[i].bits, ast_huff_specs[i].vals,
+                   ast_huff_specs[i].nvals);
+    }
+}
+
+/* ---------- bit reader ---------- */
+
+typedef struct BitReader {
+    const uint8_t *data;
+    size_t nwords;
+    size_t pos;             /* next word to load */
+    uint64_t window;        /* MSB aligned */
+    int bits;               /* valid bits in window */
+    int overrun;            /* bits consumed past the end of the data */
+} BitReader;
+
+static inline void br_refill(BitReader *br)
+{
+    while (br->bits <= 32) {
+        uint32_t word = 0;
+
+        if (br->pos < br->nwords) {
+            memcpy(&word, br->data + br->pos * 4, 4);
+            word = GUINT32_FROM_LE(word);
+        } else {
+            br->overrun += 32;
+        }
+        br->pos++;
+        br->window |= (uint64_t)word << (32 - br->bits);
+        br->bits += 32;
+    }
+}
+
+static void br_init(BitReader *br, const uint8_t *data, size_t size)
+{
+    br->data = data;
+    br->nwords = size / 4;
+    br->pos = 0;
+    br->window = 0;
+    br->bits = 0;
+    br->overrun = 0;
+    br_refill(br);
+}
+
+/* n <= 32 */
+static inline uint32_t br_peek(BitReader *br, int n)
+{
+    return (uint32_t)(br->window >> (64 - n));
+}
+
+static inline void br_skip(BitReader *br, int n)
+{
+    br->window <<= n;
+    br->bits -= n;
+    br_refill(br);
+}
+
+static inline uint32_t br_get(BitReader *br, int n)
+{
+    uint32_t v = br_peek(br, n);
+
+    br_skip(br, n);
+    return v;
+}
+
+/* the reader ran past the real data, padding is being consumed */
+static inline int br_exhausted(BitReader *br)
+{
+    return br->overrun > br->bits;
+}
+
+static inline int huff_decode(BitReader *br, const HuffTable *t)
+{
+    uint32_t look = br_peek(br, HUFF_LOOKAHEAD);
+    uint32_t code;
+    int len;
+
+    if (t->look_len[look]) {
+        br_skip(br, t->look_len[look]);
+        return t->look_val[look];
+    }
+    code = br_peek(br, 16);
+    for (len = HUFF_LOOKAHEAD + 1; len <= 16; len++) {
+        int32_t c = code >> (16 - len);
+
+        if (c <= t->maxcode[len]) {
+            br_skip(br, len);
+            return t->vals[t->valoffset[len] + c];
+        }
+    }
+    return -1;
+}
+
+static inline int extend(uint32_t v, int s)
+{
+    return v < (1u << (s - 1)) ? (int)v - (1 << s) + 1 : (int)v;
+}
+
+static int decode_component(BitReader *br, const HuffTable *dc, const HuffTable *ac,
+                            int *dc_pred, int16_t *coef)
+{
+    int s, k, rs;
+
+    memset(coef, 0, 64 * sizeof(*coef));
+
+    s = huff_decode(br, dc);
+    if (s < 0 || s > 11) {
+        return -1;
+    }
+    if (s) {
+        *dc_pred += extend(br_get(br, s), s);
+    }
+    coef[0] = *dc_pred;
+
+    for (k = 1; k < 64; k++) {
+        rs = huff_decode(br, ac);
+        if (rs < 0) {
+            return -1;
+        }
+        s = rs & 15;
+        if (s == 0) {
+            if ((rs >> 4) != 15) {
+                break;          /* EOB */
+            }
+            k += 15;            /* ZRL */
+            continue;
+        }
+        k += rs >> 4;
+        if (k > 63) {
+            return -1;
+        }
+        coef[ast_natural_order[k]] = extend(br_get(br, s), s);
+    }
+    return 0;
+}
+
+/* ---------- block walker ---------- */
+
+#define VQ_UPDATE_LENGTH    27  /* update flag, palette slot, 24-bit color */
+#define VQ_NO_UPDATE_LENGTH 3   /* update flag, palette slot */
+
+int ast_stream_walk(const AstStreamInfo *info, const uint8_t *data, size_t size,
+                    AstBlockFunc func, void *opaque, AstStreamStats *stats)
+{
+    int mb = ast_stream_mb_size(info);
+    int mbw = (info->width + mb - 1) / mb;
+    int mbh = (info->height + mb - 1) / mb;
+    int dc_pred[3] = { 0, 0, 0 };
+    AstStreamStats local;
+    AstBlock block;
+    BitReader br;
+    int x = 0, y = 0;
+
+    pthread_once(&huff_once, huff_init);
+
+    if (stats == NULL) {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof(*stats));
+    if (mbw <= 0 || mbh <= 0) {
+        return -1;
+    }
+
+    /* initial VQ palette: black, white, two greys */
+    block.vq_color[0] = 0x008080;
+    block.vq_color[1] = 0xff8080;
+    block.vq_color[2] = 0x808080;
+    block.vq_color[3] = 0xc08080;
+
+    br_init(&br, data, size);
+    for (;;) {
+        uint32_t code;
+        int base, i;
+
+        if (br_exhausted(&br)) {
+            return -1;
+        }
+
+        code = br_peek(&br, 4);
+        if (code == AST_BLOCK_FRAME_END) {
+            stats->ended = TRUE;
+            return 0;
+        }
+        if (code & AST_BLOCK_SKIP_FLAG) {
+            uint32_t pos = br_get(&br, 20);
+
+            x = (pos >> 8) & 0xff;
+            y = pos & 0xff;
+        } else {
+            br_skip(&br, 4);
+        }
+        if (x >= mbw || y >= mbh) {
+            return -1;
+        }
+
+        block.x = x;
+        block.y = y;
+        base = code & ~AST_BLOCK_SKIP_FLAG;
+        switch (base) {
+        case AST_BLOCK_JPEG_NO_SKIP:
+        case AST_BLOCK_LOW_JPEG_NO_SKIP:
+        case AST_BLOCK_JPEG_PASS2: {
+            int nluma = info->mode420 ? 4 : 1;
+
+            block.kind = base == AST_BLOCK_JPEG_NO_SKIP ? AST_BLOCK_KIND_JPEG :
+                         base == AST_BLOCK_LOW_JPEG_NO_SKIP ? AST_BLOCK_KIND_JPEG_LOW :
+                         AST_BLOCK_KIND_JPEG_PASS2;
+            block.ncomps = nluma + 2;
+            for (i = 0; i < nluma; i++) {
+                if (decode_component(&br, &huff_tables[AST_HUFF_DC_LUMINANCE],
+                                     &huff_tables[AST_HUFF_AC_LUMINANCE],
+                                     &dc_pred[0], block.coef[i]) < 0) {
+                    return -1;
+                }
+            }
+            for (i = 0; i < 2; i++) {
+                if (decode_component(&br, &huff_tables[AST_HUFF_DC_CHROMINANCE],
+                                     &huff_tables[AST_HUFF_AC_CHROMINANCE],
+                                     &dc_pred[1 + i], block.coef[nluma + i]) < 0) {
+                    return -1;
+                }
+            }
+            stats->jpeg_blocks++;
+            break;
+        }
+        case AST_BLOCK_VQ_NO_SKIP_1_COLOR:
+        case AST_BLOCK_VQ_NO_SKIP_2_COLOR:
+        case AST_BLOCK_VQ_NO_SKIP_4_COLOR: {
+            int bpp = base - AST_BLOCK_VQ_NO_SKIP_1_COLOR;   /* 0, 1 or 2 bits per pixel */
+            int ncolors = 1 << bpp;
+            uint8_t slot[4];
+
+            block.kind = AST_BLOCK_KIND_VQ;
+            block.ncomps = 0;
+            for (i = 0; i < ncolors; i++) {
+                uint32_t hdr = br_peek(&br, VQ_NO_UPDATE_LENGTH);
+
+                slot[i] = hdr & 3;
+                if (hdr >> 2) {
+                    block.vq_color[slot[i]] = br_get(&br, VQ_UPDATE_LENGTH) & 0xffffff;
+                } else {
+                    br_skip(&br, VQ_NO_UPDATE_LENGTH);
+                }
+            }
+            for (i = 0; i < 64; i++) {
+                block.vq_index[i] = slot[bpp ? br_get(&br, bpp) : 0];
+            }
+            stats->vq_blocks++;
+            break;
+        }
+        default:
+            return -1;
+        }
+
+        stats->blocks++;
+        if (func) {
+            func(&block, opaque);
+        }
+
+        if (++x >= mbw) {
+            x = 0;
+            if (++y >= mbh) {
+                y = 0;
+            }
+        }
+    }
+}
@@ -0,0 +1,120 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef __AST_STREAM_H__
+#define __AST_STREAM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Parser for the AST2100+ video engine bit stream.
+ *
+ * The payload is a sequence of 32-bit little endian words read MSB first.
+ * Every block starts with a 4-bit code; skip codes carry the macroblock
+ * position in the next 16 bits, all other blocks follow the previous one
+ * in raster order. JPEG blocks are baseline huffman coded with the
+ * standard tables (4 Y + Cb + Cr in 4:2:0 mode, Y + Cb + Cr otherwise),
+ * VQ blocks are an 8x8 block painted from a palette of up to 4 colors.
+ */
+
+#define AST_BLOCK_JPEG_NO_SKIP       0x0
+#define AST_BLOCK_JPEG_PASS2         0x2
+#define AST_BLOCK_LOW_JPEG_NO_SKIP   0x4
+#define AST_BLOCK_VQ_NO_SKIP_1_COLOR 0x5
+#define AST_BLOCK_VQ_NO_SKIP_2_COLOR 0x6
+#define AST_BLOCK_VQ_NO_SKIP_4_COLOR 0x7
+#define AST_BLOCK_JPEG_SKIP          0x8
+#define AST_BLOCK_FRAME_END          0x9
+#define AST_BLOCK_JPEG_SKIP_PASS2    0xA
+#define AST_BLOCK_LOW_JPEG_SKIP      0xC
+#define AST_BLOCK_VQ_SKIP_1_COLOR    0xD
+#define AST_BLOCK_VQ_SKIP_2_COLOR    0xE
+#define AST_BLOCK_VQ_SKIP_4_COLOR    0xF
+
+#define AST_BLOCK_SKIP_FLAG          0x8
+
+typedef enum {
+    AST_BLOCK_KIND_JPEG,
+    AST_BLOCK_KIND_JPEG_LOW,    /* coded with the advanced (low) quant table */
+    AST_BLOCK_KIND_JPEG_PASS2,  /* refinement added on top of the block */
+    AST_BLOCK_KIND_VQ,
+} AstBlockKind;
+
+typedef struct AstBlock {
+    int kind;
+    int x, y;                   /* macroblock position */
+
+    /* JPEG blocks: quantized coefficients in natural order,
+     * components Y0..Y3 (4:2:0) or Y (4:4:4) followed by Cb and Cr */
+    int ncomps;
+    int16_t coef[6][64];
+
+    /* VQ blocks: YCbCr colors packed as 0xYYUUVV and a palette index per pixel */
+    uint32_t vq_color[4];
+    uint8_t vq_index[64];
+} AstBlock;
+
+typedef struct AstStreamInfo {
+    int width;
+    int height;
+    int mode420;
+} AstStreamInfo;
+
+/* the huffman tables the engine codes with, JPEG Annex K.3 */
+typedef struct AstHuffSpec {
+    const uint8_t *bits;        /* number of codes of each length, bits[1..16] */
+    const uint8_t *vals;
+    int nvals;
+} AstHuffSpec;
+
+enum {
+    AST_HUFF_DC_LUMINANCE,
+    AST_HUFF_DC_CHROMINANCE,
+    AST_HUFF_AC_LUMINANCE,
+    AST_HUFF_AC_CHROMINANCE,
+    AST_HUFF_NTABLES
+};
+
+extern const AstHuffSpec ast_huff_specs[AST_HUFF_NTABLES];
+
+/* zigzag index -> natural order */
+extern const uint8_t ast_natural_order[64];
+
+typedef void (*AstBlockFunc)(const AstBlock *block, void *opaque);
+
+typedef struct AstStreamStats {
+    int blocks;
+    int jpeg_blocks;
+    int vq_blocks;
+    int ended;                  /* a FRAME_END code was seen */
+} AstStreamStats;
+
+/* macroblock edge in pixels */
+static inline int ast_stream_mb_size(const AstStreamInfo *info)
+{
+    return info->mode420 ? 16 : 8;
+}
+
+/* VQ color (0xYYUUVV, full range) to 0xRRGGBB */
+static inline uint32_t ast_stream_vq_rgb(uint32_t yuv)
+{
+    int y = (yuv >> 16) & 0xff;
+    int u = ((yuv >> 8) & 0xff) - 128;
+    int v = (yuv & 0xff) - 128;
+    int r = y + ((91881 * v) >> 16);
+    int g = y - ((22554 * u + 46802 * v) >> 16);
+    int b = y + ((116130 * u) >> 16);
+
+    r = r < 0 ? 0 : r > 255 ? 255 : r;
+    g = g < 0 ? 0 : g > 255 ? 255 : g;
+    b = b < 0 ? 0 : b > 255 ? 255 : b;
+    return (r << 16) | (g << 8) | b;
+}
+
+/*
+ * Walk all blocks of a frame, calling func (if not NULL) for each one.
+ * Returns 0 on success, -1 if the stream is truncated or malformed.
+ */
+int ast_stream_walk(const AstStreamInfo *info, const uint8_t *data, size_t size,
+                    AstBlockFunc func, void *opaque, AstStreamStats *stats);
+
+#endif /* __AST_STREAM_H__ */
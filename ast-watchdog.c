@@ -0,0 +1,123 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ast-watchdog.h"
+
+static const char *step_names[AST_WATCHDOG_STEPS] = {
+    "none", "clear buffers", "restart capture", "reset engine"
+};
+
+void ast_watchdog_init(AstWatchdog *wd, int stall_ms)
+{
+    memset(wd, 0, sizeof(*wd));
+    wd->stall_ms = MAX(stall_ms, 0);
+}
+
+static void ast_watchdog_good(AstWatchdog *wd, gint64 now)
+{
+    wd->bad_since = 0;
+    if (wd->stall_start == 0) {
+        return;
+    }
+    __atomic_store_n(&wd->recover_us_last, now - wd->stall_start, __ATOMIC_RELAXED);
+    __atomic_store_n(&wd->recover_us_max, MAX(wd->recover_us_max, wd->recover_us_last),
+                     __ATOMIC_RELAXED);
+    printf("watchdog: engine recovered after %.1f s, last step: %s\n",
+           wd->recover_us_last / (double)G_USEC_PER_SEC, step_names[wd->step]);
+    __atomic_store_n(&wd->stall_start, 0, __ATOMIC_RELAXED);
+    wd->step = AST_WATCHDOG_NONE;
+}
+
+static AstWatchdogStep ast_watchdog_bad(AstWatchdog *wd, gint64 now)
+{
+    if (wd->bad_since == 0) {
+        wd->bad_since = now;
+    }
+    if (wd->stall_start == 0) {
+        if (now - wd->bad_since < (gint64)wd->stall_ms * 1000) {
+            return AST_WATCHDOG_NONE;
+        }
+        /* recovery time counts from the first bad result */
+        __atomic_store_n(&wd->stall_start, wd->bad_since, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&wd->stalls, 1, __ATOMIC_RELAXED);
+        wd->step = AST_WATCHDOG_NONE;
+        wd->backoff_ms = AST_WATCHDOG_BACKOFF_MIN_MS;
+        wd->next_step = now;
+        printf("watchdog: engine stalled, %" G_GUINT64_FORMAT " errors and %"
+               G_GUINT64_FORMAT " stale frames so far\n", wd->errors, wd->stale);
+    }
+    if (now < wd->next_step) {
+        return AST_WATCHDOG_NONE;
+    }
+
+    /* the strongest step is repeated until it helps */
+    if (wd->step < AST_WATCHDOG_RESET) {
+        wd->step++;
+    }
+    __atomic_add_fetch(&wd->steps[wd->step], 1, __ATOMIC_RELAXED);
+    wd->next_step = now + (gint64)wd->backoff_ms * 1000;
+    printf("watchdog: %s, next step in %d ms\n", step_names[wd->step], wd->backoff_ms);
+    wd->backoff_ms = MIN(wd->backoff_ms * 2, AST_WATCHDOG_BACKOFF_MAX_MS);
+    return wd->step;
+}
+
+AstWatchdogStep ast_watchdog_update(AstWatchdog *wd, gint64 now, AstWatchdogResult result,
+                                    int frame_num, int comp_size)
+{
+    int stale;
+
+    if (wd->stall_ms == 0) {
+        return AST_WATCHDOG_NONE;
+    }
+
+    switch (result) {
+    case AST_WATCHDOG_FAILED:
+        __atomic_add_fetch(&wd->errors, 1, __ATOMIC_RELAXED);
+        return ast_watchdog_bad(wd, now);
+    case AST_WATCHDOG_UNCHANGED:
+        ast_watchdog_good(wd, now);
+        return AST_WATCHDOG_NONE;
+    default:
+        break;
+    }
+
+    /* a reset may restart frame_num, so any other number is progress */
+    if (wd->frame_valid && comp_size == wd->comp_size) {
+        wd->size_repeats++;
+    } else {
+        wd->size_repeats = 0;
+    }
+    stale = comp_size <= 0 || wd->size_repeats >= AST_WATCHDOG_SIZE_REPEATS ||
+            (wd->frame_valid && frame_num == wd->frame_num);
+    wd->frame_valid = TRUE;
+    wd->frame_num = frame_num;
+    wd->comp_size = comp_size;
+    if (stale) {
+        __atomic_add_fetch(&wd->stale, 1, __ATOMIC_RELAXED);
+        return ast_watchdog_bad(wd, now);
+    }
+    ast_watchdog_good(wd, now);
+    return AST_WATCHDOG_NONE;
+}
+
+void ast_watchdog_print(AstWatchdog *wd)
+{
+    if (wd->stall_ms == 0) {
+        return;
+    }
+    printf("watchdog: %s, %" G_GUINT64_FORMAT " errors, %" G_GUINT64_FORMAT
+           " stale frames, %" G_GUINT64_FORMAT " stalls, steps %" G_GUINT64_FORMAT
+           "/%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " (clear/restart/reset),"
+           " recovered in %.1f s, worst %.1f s\n",
+           __atomic_load_n(&wd->stall_start, __ATOMIC_RELAXED) ? "stalled" : "ok",
+           __atomic_load_n(&wd->errors, __ATOMIC_RELAXED),
+           __atomic_load_n(&wd->stale, __ATOMIC_RELAXED),
+           __atomic_load_n(&wd->stalls, __ATOMIC_RELAXED),
+           __atomic_load_n(&wd->steps[AST_WATCHDOG_CLEAR], __ATOMIC_RELAXED),
+           __atomic_load_n(&wd->steps[AST_WATCHDOG_RESTART], __ATOMIC_RELAXED),
+           __atomic_load_n(&wd->steps[AST_WATCHDOG_RESET], __ATOMIC_RELAXED),
+           __atomic_load_n(&wd->recover_us_last, __ATOMIC_RELAXED) / (double)G_USEC_PER_SEC,
+           __atomic_load_n(&wd->recover_us_max, __ATOMIC_RELAXED) / (double)G_USEC_PER_SEC);
+}
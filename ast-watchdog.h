@@ -0,0 +1,73 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef __AST_WATCHDOG_H__
+#define __AST_WATCHDOG_H__
+
+#include <stdint.h>
+#include <glib.h>
+
+/*
+ * Video engine watchdog.
+ *
+ * Follows the GET_VIDEO results and notices an engine that stopped
+ * working: calls that fail, frames that keep coming back with the same
+ * frame_num, or a comp_size stuck for a long run of frames (a few repeats
+ * are normal, the engine resends identical frames). Once that has gone on for the stall
+ * time it asks for recovery steps, from clearing the buffers over
+ * restarting capture to resetting the engine, with a backoff between
+ * steps that doubles while nothing helps. A new frame, or the engine
+ * reporting no change, ends the stall.
+ *
+ * The steps only touch the engine, spice sessions stay connected.
+ *
+ * Updated from the capture side, printed from the main loop.
+ */
+
+#define AST_WATCHDOG_STALL_MS_DEFAULT 2000
+#define AST_WATCHDOG_BACKOFF_MIN_MS 250
+#define AST_WATCHDOG_BACKOFF_MAX_MS 30000
+/* frames in a row with the same comp_size before they count as stale */
+#define AST_WATCHDOG_SIZE_REPEATS 32
+
+typedef enum {
+    AST_WATCHDOG_FAILED,        /* GET_VIDEO failed */
+    AST_WATCHDOG_UNCHANGED,     /* the engine answered, nothing new */
+    AST_WATCHDOG_FRAME,         /* the engine returned a frame */
+} AstWatchdogResult;
+
+typedef enum {
+    AST_WATCHDOG_NONE,
+    AST_WATCHDOG_CLEAR,         /* CLEAR_BUFFERS */
+    AST_WATCHDOG_RESTART,       /* STOP_CAPTURE, START_CAPTURE */
+    AST_WATCHDOG_RESET,         /* RESET_VIDEOENGINE, START_CAPTURE */
+    AST_WATCHDOG_STEPS,
+} AstWatchdogStep;
+
+typedef struct AstWatchdog {
+    int stall_ms;           /* 0: disabled */
+
+    int frame_valid;
+    int frame_num;          /* of the last frame */
+    int comp_size;
+    int size_repeats;
+    gint64 bad_since;       /* first failed or stale result in a row, 0 if none */
+
+    gint64 stall_start;     /* 0 while the engine is healthy */
+    AstWatchdogStep step;   /* last recovery step taken */
+    gint64 next_step;
+    int backoff_ms;
+
+    uint64_t errors;
+    uint64_t stale;
+    uint64_t stalls;
+    uint64_t steps[AST_WATCHDOG_STEPS];
+    gint64 recover_us_last;
+    gint64 recover_us_max;
+} AstWatchdog;
+
+void ast_watchdog_init(AstWatchdog *wd, int stall_ms);
+/* frame_num and comp_size are only looked at for AST_WATCHDOG_FRAME */
+AstWatchdogStep ast_watchdog_update(AstWatchdog *wd, gint64 now, AstWatchdogResult result,
+                                    int frame_num, int comp_size);
+void ast_watchdog_print(AstWatchdog *wd);
+
+#endif /* __AST_WATCHDOG_H__ */
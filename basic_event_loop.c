@@ -159,10 +159,24 @@ static void watch_remove(SpiceWatch *watch)
     g_free(watch);
 }
 
+static void (*channel_event_func)(int event, SpiceChannelEventInfo *info, void *opaque);
+static void *channel_event_opaque;
+
 static void channel_event(int event, SpiceChannelEventInfo *info)
 {
     DPRINTF(0, "channel event con, type, id, event: %d, %d, %d, %d",
             info->connection_id, info->type, info->id, event);
+    if (channel_event_func) {
+        channel_event_func(event, info, channel_event_opaque);
+    }
+}
+
+void basic_event_loop_set_channel_event(void (*func)(int event, SpiceChannelEventInfo *info,
+                                                     void *opaque),
+                                        void *opaque)
+{
+    channel_event_func = func;
+    channel_event_opaque = opaque;
 }
 
 void basic_event_loop_mainloop(void)
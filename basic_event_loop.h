@@ -22,5 +22,9 @@
 
 SpiceCoreInterface *basic_event_loop_init(void);
 void basic_event_loop_mainloop(void);
+/* pass spice's channel events on to func, on the main loop */
+void basic_event_loop_set_channel_event(void (*func)(int event, SpiceChannelEventInfo *info,
+                                                     void *opaque),
+                                        void *opaque);
 
 #endif // __BASIC_EVENT_LOOP_H__
@@ -421,11 +421,13 @@ static const SpiceMouseInterface mouse_interface = {
     .buttons            = mouse_buttons,
 };
 
-int main(void)
+int main(int argc, char **argv)
 {
     Test *test;
     iUSBSpiceKbd *kbd;
 
+    spice_test_config_parse_args(argc, argv);
+
     core = basic_event_loop_init();
     test = ast_new(core);
 
@@ -457,25 +459,34 @@ int main(void)
 
     iusb_set_mouse_mode(&test->pointer.iusb, spice_server_is_server_mouse(test->server));
 
-    test->videocap_fd = open(ASPEED_ENCODER_VIDEOCAP_DEV, O_RDONLY);
+    test->videocap_fd = open(ASPEED_ENCODER_VIDEOCAP_DEV, test->zero_copy ? O_RDWR : O_RDONLY);
+    if (test->videocap_fd < 0 && test->zero_copy) {
+        printf("unable to open videocap device for writing: %d, zero-copy disabled\n", errno);
+        test->zero_copy = 0;
+        test->videocap_fd = open(ASPEED_ENCODER_VIDEOCAP_DEV, O_RDONLY);
+    }
     if (test->videocap_fd < 0) {
         printf("unable to open videocap device: %d", errno);
         return -1;
     }
-    test->mmap = mmap(0, 0x404000, PROT_READ, MAP_SHARED, test->videocap_fd, 0);
-    if (test->mmap == MAP_FAILED) {
+    if (ast_map_videocap(test) < 0) {
         close(test->videocap_fd);
-        printf("unable to mmap videocap device: %d", errno);
         return -1;
     }
 
-    bzero(&test->ioc, sizeof(ASTCap_Ioctl));
-    test->ioc.OpCode = ASTCAP_IOCTL_RESET_VIDEOENGINE;
-    ioctl(test->videocap_fd, ASTCAP_IOCCMD, &test->ioc);
+    /* before the capture side starts, so its context is still free */
+    bzero(&test->capture.ioc, sizeof(ASTCap_Ioctl));
+    test->capture.ioc.OpCode = ASTCAP_IOCTL_RESET_VIDEOENGINE;
+    ioctl(test->videocap_fd, ASTCAP_IOCCMD, &test->capture.ioc);
+
+    /* running, so the capture side snapshots a frame for the first viewer
+     * before it parks the engine */
+    bzero(&test->capture.ioc, sizeof(ASTCap_Ioctl));
+    test->capture.ioc.OpCode = ASTCAP_IOCTL_START_CAPTURE;
+    ioctl(test->videocap_fd, ASTCAP_IOCCMD, &test->capture.ioc);
+    test->engine_running = TRUE;
 
-    bzero(&test->ioc, sizeof(ASTCap_Ioctl));
-    test->ioc.OpCode = ASTCAP_IOCTL_START_CAPTURE;
-    ioctl(test->videocap_fd, ASTCAP_IOCCMD, &test->ioc);
+    ast_start_capture(test);
 
     ping_timer = core->timer_add(pinger, NULL);
     core->timer_start(ping_timer, ping_ms);
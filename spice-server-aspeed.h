@@ -4,8 +4,14 @@
 #include <spice-server/spice.h>
 #include <linux/types.h>
 #include <sys/ioctl.h>
+#include <glib.h>
 
 #include "basic_event_loop.h"
+#include "ast-pacing.h"
+#include "ast-compress.h"
+#include "ast-sched.h"
+#include "ast-watchdog.h"
+#include "ast-budget.h"
 
 #define COUNT(x) ((sizeof(x)/sizeof(x[0])))
 
@@ -22,7 +28,7 @@ typedef enum FPGA_opcode {
     ASTCAP_IOCTL_CLEAR_BUFFERS,
     ASTCAP_IOCTL_SET_VIDEOENGINE_CONFIGS,
     ASTCAP_IOCTL_GET_VIDEOENGINE_CONFIGS,
-    ASTCAP_IOCTL_SET_SCALAR_CONFIGS,
+    ASTCAP_IOCTL_SET_SCALAR_CONFIGS,	/* unused, payload layout not known */
     ASTCAP_IOCTL_ENABLE_VIDEO_DAC,
 } ASTCap_OpCode;
 
@@ -41,6 +47,21 @@ typedef struct {
 	unsigned char Reserved [2];
 } ASTCap_Ioctl;
 
+/* ASTCAP_IOCTL_{GET,SET}_VIDEOENGINE_CONFIGS, passed through vPtr */
+typedef struct {
+	uint8_t differential_setting;
+	uint16_t dct_quant_quality;
+	uint16_t dct_quant_tbl_select;		/* jpeg_table */
+	uint16_t sharp_mode_selection;
+	uint16_t sharp_quant_quality;
+	uint16_t sharp_quant_tbl_select;	/* adv_table */
+	uint16_t compression_mode;		/* AST_ENGINE_YUV* */
+	uint16_t vga_dac;
+} __attribute__((packed)) ast_videocap_engine_config_t;
+
+#define AST_ENGINE_YUV444	0
+#define AST_ENGINE_YUV420	1
+
 /* Note :All Length Fields used in IUSB are Little Endian */
 
 typedef uint8_t u8;
@@ -357,6 +378,11 @@ typedef enum {
     SLEEP
 } CommandType;
 
+typedef enum {
+    CAPTURE_MODE_THREAD,
+    CAPTURE_MODE_TIMER,
+} CaptureMode;
+
 typedef struct CommandCreatePrimary {
     uint32_t width;
     uint32_t height;
@@ -414,6 +440,14 @@ struct Command {
 #define AST_VIDEOCAP_CURSOR_BITMAP			(64 * 64)
 #define AST_VIDEOCAP_CURSOR_BITMAP_DATA		(AST_VIDEOCAP_CURSOR_BITMAP * 2)
 
+/* layout of the /dev/videocap mapping, the defaults of AstVideocapLayout */
+#define AST_VIDEOCAP_HDR_SIZE			88
+#define AST_VIDEOCAP_CURSOR_OFFSET		0x1000
+#define AST_VIDEOCAP_DATA_OFFSET		0x4000
+#define AST_VIDEOCAP_MMAP_SIZE			0x404000
+/* largest mapping probed for */
+#define AST_VIDEOCAP_MMAP_MAX			(64 << 20)
+
 struct ast_videocap_cursor_info_t {
 	uint8_t type; /* 0: monochrome, 1: color */
 	uint32_t checksum;
@@ -448,6 +482,39 @@ typedef struct iUSBSpicePointer {
     int last_x, last_y;
 } iUSBSpicePointer;
 
+/*
+ * Where the driver puts the frame header (at 0), the cursor info and the
+ * payload in its buffer. The size is probed at startup, see
+ * ast_map_videocap(); the offsets can only be given on the command line.
+ */
+typedef struct AstVideocapLayout {
+    size_t size;
+    size_t cursor_offset;
+    size_t data_offset;
+} AstVideocapLayout;
+
+/*
+ * Every thread that talks to /dev/videocap owns a context with its own
+ * ioctl buffer, so GET_VIDEO and GET_CURSOR can run concurrently. What
+ * one thread publishes to the others (the primary size, the pointer
+ * position) is written by its owner and read with atomic loads.
+ */
+
+/* the capture thread, or the main loop with --capture=timer */
+typedef struct AstCaptureCtx {
+    ASTCap_Ioctl ioc;       /* GET_VIDEO of the frame being built */
+    gint64 budget_due;      /* the bandwidth budget allows no frame before this */
+} AstCaptureCtx;
+
+/* the red_worker thread, through get_cursor_command() */
+typedef struct AstCursorCtx {
+    ASTCap_Ioctl ioc;
+    struct ast_videocap_cursor_info_t curinfo;
+    int shape_pending;      /* a new shape waits for the next command */
+    int notify;             /* commands to poll, refilled by the main loop */
+    gint64 notify_time;     /* when the main loop refilled it */
+    int sched_applied;
+} AstCursorCtx;
 
 struct Test {
     SpiceCoreInterface *core;
@@ -457,13 +524,25 @@ struct Test {
     QXLWorker *qxl_worker;
 
     uint8_t primary_surface[1];
+    uint8_t *primary_mem;   /* backs the primary with --image=bitmap */
+    size_t primary_mem_size;
+    /* written by the capture side */
     int primary_height;
     int primary_width;
 
     SpiceTimer *wakeup_timer;
     int wakeup_ms;
+    gint64 wakeup_due;
+
+    int capture_mode;
+    GThread *capture_thread;
+    int capture_event;      /* eventfd, kicked when a frame slot is freed */
+    int capture_poll_dev;   /* the videocap fd signals new frames via poll() */
+    gint64 capture_due;     /* next GET_VIDEO in timer mode */
+    AstPacing pacing;
 
-    int cursor_notify;
+    AstCaptureCtx capture;
+    AstCursorCtx cursor;
 
     // qxl scripted rendering commands and io
     Command *commands;
@@ -476,15 +555,68 @@ struct Test {
     void (*on_client_connected)(Test *test);
     void (*on_client_disconnected)(Test *test);
 
-    int started;
+    int started;            /* display clients watching, set by the main loop */
+    GHashTable *display_links;  /* connection id -> ViewerLink, main loop */
+    int keyframe_request;   /* KEYFRAME_* reasons for a full frame, any thread */
+    /* with nobody watching the engine is stopped and the timers parked */
+    int engine_running;     /* capture side only */
+    int wakeup_parked;      /* do_wakeup() let the timer lapse */
+    gint64 resume_time;     /* the first viewer arrived, until its first frame */
 
     iUSBSpicePointer pointer;
-    struct ast_videocap_cursor_info_t curinfo;
 
     /* ---------- Aspeed private ---------- */
     int videocap_fd;
     void *mmap;
-    ASTCap_Ioctl ioc;
+    AstVideocapLayout layout;
+
+    /* hand the mapped capture buffer to the worker instead of a copy */
+    int zero_copy;
+    /* depth of the capture -> red_worker pipeline */
+    int frame_slots;
+    int queue_policy;
+    int dump_frames;
+    /* send only the changed macroblocks of a frame */
+    int partial_updates;
+
+    /* engine quality, adjusted from the capture side */
+    AstCompress compress;
+    /* bandwidth the stream may take, frames wait for it on the capture side */
+    AstBudget budget;
+    ast_videocap_engine_config_t engine_config;
+    int engine_config_valid;
+
+    /* how long a new source mode must persist before the primary is resized */
+    int mode_debounce_ms;
+
+    /* release latency past which capture waits for the slowest viewer */
+    int lag_latest_ms;
+    int lagging;
+
+    /* drop frames whose payload repeats the last one */
+    int dedupe;
+
+    /* decode frames here and send bitmaps, for clients without an AST decoder */
+    int decode_bitmaps;
+    /* bitmaps carry content hashes as ids and go to the clients' image cache */
+    int image_cache;
+    /* rewrap frames as MJPEG for the stream channel */
+    int mjpeg_stream;
+
+    /* thread placement and how often each context ran late */
+    AstSched sched_capture;
+    AstSched sched_cursor;
+    AstSched sched_input;
+    int mlock;
+    AstDeadline deadline_capture;
+    AstDeadline deadline_cursor;
+    AstDeadline deadline_input;
+
+    /* notices a stuck engine and recovers it, capture side only */
+    AstWatchdog watchdog;
+
+    SpiceTimer *stats_timer;
+    int stats_interval;
 };
 
 struct ASTHeader
@@ -547,6 +679,8 @@ void test_set_command_list(Test *test, Command *command, int num_commands);
 void test_add_display_interface(Test *test);
 void test_add_agent_interface(SpiceServer *server); // TODO - Test *test
 Test* ast_new(SpiceCoreInterface* core);
+int ast_map_videocap(Test *test);
+void ast_start_capture(Test *test);
 
 uint32_t test_get_width(void);
 uint32_t test_get_height(void);
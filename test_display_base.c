@@ -3,6 +3,7 @@
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/wait.h>
@@ -10,13 +11,26 @@
 #include <sys/types.h>
 #include <getopt.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <errno.h>
 #include <glib.h>
 
 #include <spice-server/spice.h>
 #include <spice/qxl_dev.h>
+#include <spice/stream-device.h>
 
 #include "spice-server-aspeed.h"
+#include "ast-ring.h"
+#include "ast-pool.h"
+#include "ast-stream.h"
+#include "ast-decode.h"
+#include "ast-mjpeg.h"
+#include "ast-hash.h"
+#include "ast-sched.h"
 #include "test_util.h"
+#include "basic_event_loop.h"
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -27,6 +41,27 @@
 #define NOTIFY_DISPLAY_BATCH (SINGLE_PART/2)
 #define NOTIFY_CURSOR_BATCH 10
 
+#define WAKEUP_MS_DEFAULT 50
+#define MODE_DEBOUNCE_MS_DEFAULT 500
+/* release latency beyond which capture waits for the slowest viewer */
+#define LAG_LATEST_MS_DEFAULT 300
+
+/* why a full frame was asked for, bits of Test.keyframe_request */
+enum {
+    KEYFRAME_CLIENT,        /* a viewer joined */
+    KEYFRAME_GAP,           /* a frame never reached the clients */
+    KEYFRAME_CACHE_RESET,   /* the worker dropped what it held for the clients */
+    KEYFRAME_REFINE,        /* the screen settled, resend it at full quality */
+    KEYFRAME_MODE,          /* the primary was recreated for a new mode */
+    KEYFRAME_STREAM,        /* the MJPEG stream stopped, display clients resume */
+    KEYFRAME_REASONS,
+};
+
+/* shown instead of a 0x0 surface while the host has no video signal */
+#define NO_SIGNAL_COLOR 0x000000
+/* what the engine's BLANK_SCREEN stands for */
+#define BLANK_COLOR 0x000000
+
 #define DEFAULT_WIDTH 800
 #define DEFAULT_HEIGHT 600
 
@@ -49,14 +84,315 @@ static void sigchld_handler(SPICE_GNUC_UNUSED int signal_num) // wait for the ch
 
 /* Parts cribbed from spice-display.h/.c/qxl.c */
 
+/* changed areas of a partial frame, beyond that only the bounding box is sent */
+#define PARTIAL_RECTS_MAX 16
+
 typedef struct SimpleSpiceUpdate {
     QXLCommandExt ext; // first
     QXLDrawable drawable;
     QXLImage image;
     uint8_t *bitmap;
+    struct {
+        QXLClipRects clip;
+        QXLRect rects[PARTIAL_RECTS_MAX]; // clip.chunk data
+    } __attribute__((packed)) clip_rects;
 } SimpleSpiceUpdate;
 
-SimpleSpiceUpdate *cmd_ext = NULL;
+/*
+ * Capture pipeline: each slot carries one frame (drawable, header and
+ * payload) from GET_VIDEO to release_resource(), so the next frame can be
+ * captured while earlier ones are still owned by the red_worker.
+ *
+ * FREE and CAPTURING are owned by the capture side, QUEUED is handed over
+ * to the worker and IN_FLIGHT is owned by the worker until release.
+ *
+ * A slot is captured and encoded once however many clients watch: the
+ * worker keeps one reference to the drawable per display channel client
+ * and calls release_resource() when the last of them is done with it.
+ */
+typedef enum {
+    FRAME_SLOT_FREE,
+    FRAME_SLOT_CAPTURING,
+    FRAME_SLOT_QUEUED,
+    FRAME_SLOT_IN_FLIGHT,
+    FRAME_SLOT_NSTATES
+} FrameSlotState;
+
+static const char *frame_slot_state_names[FRAME_SLOT_NSTATES] = {
+    "free", "capturing", "queued", "in-flight",
+};
+
+typedef struct FrameSlot {
+    SimpleSpiceUpdate update;
+    int state;
+    uint32_t seq;
+    gint64 queued_time;
+    uint8_t *buf;           /* from payload_pool, NULL in zero-copy mode */
+    uint32_t size;          /* charged to the budget once queued */
+} FrameSlot;
+
+#define FRAME_SLOTS_MAX 8
+#define FRAME_SLOTS_DEFAULT 3
+
+static FrameSlot frame_slots[FRAME_SLOTS_MAX];
+static uint32_t frame_seq;
+
+/* QUEUED slots on their way from the capture side to get_command() */
+static AstRing frame_ring;
+
+/* header + payload copies of captured frames, or decoded bitmaps */
+static AstBufPool payload_pool;
+
+/* the engine's reference frame for --image=bitmap, capture side only */
+static AstDecoder decoder;
+
+typedef struct CursorUpdate {
+    QXLCommandExt ext; // first
+    QXLCursorCmd cmd;
+} CursorUpdate;
+
+/* cursor commands in flight; the worker keeps the current shape around */
+#define CURSOR_POOL_SIZE 32
+static AstPool cursor_pool;
+
+/*
+ * --mjpeg-stream: frames rewrapped as JPEG go to spice through a stream
+ * port, the same way spice-streaming-agent feeds it, so clients get them
+ * on a stream channel. Messages are built by the capture side in a
+ * buffer from stream_pool and read by spice on the main loop.
+ */
+#define STREAM_PORT_NAME "org.spice-space.stream.0"
+#define STREAM_MSGS 4
+
+typedef struct StreamMsg {
+    size_t len;
+    uint8_t data[];         /* StreamDevHeader + payload, possibly two messages */
+} StreamMsg;
+
+static AstBufPool stream_pool;
+
+static struct {
+    SpiceCharDeviceInstance sin;
+    Test *test;
+    int event;              /* eventfd, kicked when a message is queued */
+    SpiceWatch *watch;
+
+    /* capture side */
+    AstMjpeg mjpeg;
+    int format_width, format_height;    /* format last queued */
+    int cleared;            /* mjpeg.resets CLEAR_BUFFERS was issued for */
+
+    /* capture side -> main loop */
+    AstRing ring;
+    int started;            /* a client takes MJPEG, set by the main loop */
+    int restart;            /* send the format again */
+
+    /* main loop */
+    StreamMsg *msg;         /* being read by spice */
+    size_t pos;
+    uint8_t in[256];        /* message from spice being written */
+    size_t in_len;
+} stream_port;
+
+typedef enum {
+    QUEUE_POLICY_FIFO,   /* deliver every captured frame in order */
+    QUEUE_POLICY_LATEST, /* capture only once the worker took the last frame */
+} QueuePolicy;
+
+static struct {
+    uint64_t captured;
+    uint64_t no_change;
+    uint64_t delivered;
+    uint64_t released;
+    uint64_t stalled;
+    uint64_t ring_full;
+    uint32_t depth_max;
+    uint64_t depth_sum;
+    uint64_t samples;
+    uint64_t occupancy[FRAME_SLOT_NSTATES];
+    uint64_t partial;
+    uint64_t partial_failed;
+    uint64_t partial_area;
+    uint64_t partial_screen;
+    uint64_t mode_changes;
+    uint64_t mode_flaps;
+    uint64_t mode_settling;
+    uint64_t no_signal;
+    uint64_t fills;
+    uint64_t solid;
+    uint64_t resync;
+    uint64_t decoded;
+    uint64_t decode_failed;
+    uint64_t decode_us;
+    uint64_t decode_area;
+    uint64_t decode_screen;
+    uint64_t stream_frames;
+    uint64_t stream_bytes;
+    uint64_t stream_dropped;
+    uint64_t stream_incomplete;
+    uint64_t stream_failed;
+    uint64_t keyframes;
+    uint64_t keyframe_reasons[KEYFRAME_REASONS];
+    uint64_t lag_periods;
+    gint64 lag_since;
+    gint64 lag_time;
+    uint64_t hashed;
+    uint64_t hash_us;
+    uint64_t dup_frames;
+    uint64_t dup_bytes;
+    uint64_t dup_kept;
+    uint64_t images_cached;
+    uint64_t images_repeated;
+    uint64_t image_hash_us;
+    uint64_t overflow;
+    uint64_t parks;
+    gint64 park_since;
+    gint64 park_time;
+    uint64_t resumes;
+    gint64 first_frame_us;
+    gint64 first_frame_us_max;
+    uint64_t instant_frames;
+    /* main loop only */
+    uint64_t last_delivered;
+    gint64 last_report;
+} pipeline_stats;
+
+/*
+ * The counters are written on the capture side, delivered, released and
+ * first_frame_us by the worker, and read and partly reset by the stats
+ * timer on the main loop, so every access is a relaxed atomic.
+ */
+#define STAT_ADD(field, n) __atomic_add_fetch(&pipeline_stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_GET(field) __atomic_load_n(&pipeline_stats.field, __ATOMIC_RELAXED)
+#define STAT_SET(field, v) __atomic_store_n(&pipeline_stats.field, (v), __ATOMIC_RELAXED)
+#define STAT_TAKE(field) __atomic_exchange_n(&pipeline_stats.field, 0, __ATOMIC_RELAXED)
+
+/* engine frame numbers seen on the capture side, to notice frames never fetched */
+static struct {
+    int valid;
+    int frame_num;          /* of the last frame */
+    int no_change;          /* unchanged polls since, they may have used a number */
+} frame_nums;
+
+/* source mode waiting to settle before the primary is recreated, capture side only */
+static struct {
+    int width, height;      /* -1: nothing pending */
+    gint64 since;
+    int no_signal;          /* the placeholder is on screen */
+} mode_state = { -1, -1, 0, FALSE };
+
+/* solid fill over the current primary, rebuilt only when its size or color changes */
+static struct {
+    int width, height;
+    uint32_t color;
+    QXLDrawable drawable;
+} fill_cache;
+
+/*
+ * A fill leaves the client's AST decoder behind the engine's reference
+ * frame, so once one is on screen only a full frame may follow it.
+ */
+static struct {
+    int active;             /* the screen is the fill below */
+    uint32_t color;
+    int need_full_frame;
+} solid_state;
+
+/*
+ * A full frame of the screen, taken when capture parks, so the next first
+ * viewer sees it at once instead of waiting for the engine to restart.
+ * Capture side only.
+ */
+static struct {
+    uint8_t *buf;           /* header and payload, as an AST image carries them */
+    size_t buf_size;
+    size_t size;            /* of the payload */
+    int valid;
+    int pending;            /* queue it ahead of the next capture */
+} last_frame;
+
+/* the last frame handed on, to drop byte-identical repeats, capture side only */
+static struct {
+    int valid;
+    uint64_t hash;
+    uint32_t size;
+    int width, height;
+    int mode420;
+    int jpeg_table;
+    int adv_table;
+} frame_dedupe;
+
+/*
+ * Decoded bitmaps are addressed by content: the image id is a hash of
+ * the pixels and carries QXL_IMAGE_CACHE, so spice keeps them in every
+ * client's pixmap cache, tracks what each client holds and sends a
+ * screen seen before as a cache reference. The ids below only tell how
+ * often screens come back; whether a client still held one is spice's
+ * business and not reported back. AST images are never cached, a hit would
+ * bypass the client's decoder and leave it behind the engine's
+ * reference frame.
+ */
+#define IMAGE_IDS_RECENT 64
+
+static struct {
+    uint64_t ids[IMAGE_IDS_RECENT];
+    int next;
+} image_ids;
+
+/* macroblocks touched by the frame being captured, capture side only */
+static struct {
+    int mbw, mbh;
+    uint8_t dirty[(MAX_WIDTH / 8) * (MAX_HEIGHT / 8)];
+} partial_map;
+
+static struct {
+    int zero_copy;
+    int frame_slots;
+    int stats_interval;
+    int queue_policy;
+    int capture_mode;
+    int min_fps;
+    int max_fps;
+    int dump_frames;
+    int partial_updates;
+    int max_kbps;
+    int max_latency;
+    int refine_ms;
+    int motion_level;
+    int budget_kbps;
+    int client_budget_kbps;
+    int mode_debounce_ms;
+    int decode_bitmaps;
+    const char *quant_tables;
+    int scalar_decode;
+    int mjpeg_stream;
+    int lag_latest_ms;
+    int no_dedupe;
+    int no_image_cache;
+    AstSched sched_capture;
+    AstSched sched_cursor;
+    AstSched sched_input;
+    int mlockall;
+    AstVideocapLayout layout;
+    int watchdog_ms;
+} options = {
+    .frame_slots = FRAME_SLOTS_DEFAULT,
+    .capture_mode = CAPTURE_MODE_THREAD,
+    .min_fps = AST_PACING_MIN_FPS_DEFAULT,
+    .max_fps = AST_PACING_MAX_FPS_DEFAULT,
+    .mode_debounce_ms = MODE_DEBOUNCE_MS_DEFAULT,
+    .lag_latest_ms = LAG_LATEST_MS_DEFAULT,
+    .motion_level = AST_COMPRESS_MOTION_LEVEL_DEFAULT,
+    .watchdog_ms = AST_WATCHDOG_STALL_MS_DEFAULT,
+    .sched_capture = { .policy = -1 },
+    .sched_cursor = { .policy = -1 },
+    .sched_input = { .policy = -1 },
+    .layout = {
+        .size = 0,              /* probed */
+        .cursor_offset = AST_VIDEOCAP_CURSOR_OFFSET,
+        .data_offset = AST_VIDEOCAP_DATA_OFFSET,
+    },
+};
 
 typedef struct Path {
     int t;
@@ -86,8 +422,9 @@ static void create_primary_surface(Test *test, uint32_t width,
     ASSERT(height <= MAX_HEIGHT);
     ASSERT(width <= MAX_WIDTH);
 
-    test->primary_width = width;
-    test->primary_height = height;
+    /* the cursor and the stats read the size from other threads */
+    __atomic_store_n(&test->primary_width, width, __ATOMIC_RELAXED);
+    __atomic_store_n(&test->primary_height, height, __ATOMIC_RELAXED);
 
     if (width == 0 || height == 0) {
         width  = DEFAULT_WIDTH;
@@ -103,6 +440,17 @@ static void create_primary_surface(Test *test, uint32_t width,
     surface.type       = 0;    /* unused by red_worker */
     surface.position   = 0;    /* unused by red_worker */
     surface.mem        = (uintptr_t)&test->primary_surface;
+    if (test->decode_bitmaps) {
+        /* bitmaps are drawn by the worker, so it needs real memory to draw into */
+        size_t size = (size_t)width * height * 4;
+
+        if (size > test->primary_mem_size) {
+            g_free(test->primary_mem);
+            test->primary_mem = g_malloc0(size);
+            test->primary_mem_size = size;
+        }
+        surface.mem = (uintptr_t)test->primary_mem;
+    }
     surface.group_id   = MEM_SLOT_GROUP_ID;
 
     spice_qxl_create_primary_surface(&test->qxl_instance, 0, &surface);
@@ -146,39 +494,1027 @@ void *load_frame(unsigned long *size)
     return hdr;
 }
 
-/* bitmap and rects are freed, so they must be allocated with malloc */
-SimpleSpiceUpdate *test_spice_create_update_from_bitmap(Test *test, uint32_t surface_id)
+static inline int frame_slot_get_state(FrameSlot *slot)
+{
+    return __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+}
+
+static inline void frame_slot_set_state(FrameSlot *slot, int state)
+{
+    __atomic_store_n(&slot->state, state, __ATOMIC_RELEASE);
+}
+
+/* return the payload buffer to the pool and the slot to the capture side */
+static void frame_slot_recycle(FrameSlot *slot)
+{
+    if (slot->buf != NULL) {
+        ast_buf_pool_put(&payload_pool, slot->buf);
+        slot->buf = NULL;
+    }
+    frame_slot_set_state(slot, FRAME_SLOT_FREE);
+}
+
+static FrameSlot *frame_slot_get_free(Test *test)
+{
+    int i;
+
+    for (i = 0; i < test->frame_slots; i++) {
+        if (frame_slot_get_state(&frame_slots[i]) == FRAME_SLOT_FREE) {
+            return &frame_slots[i];
+        }
+    }
+    return NULL;
+}
+
+static void pipeline_sample(Test *test)
+{
+    uint32_t depth = ast_ring_count(&frame_ring);
+    int i;
+
+    for (i = 0; i < test->frame_slots; i++) {
+        STAT_ADD(occupancy[frame_slot_get_state(&frame_slots[i])], 1);
+    }
+    STAT_ADD(depth_sum, depth);
+    if (depth > STAT_GET(depth_max)) {
+        STAT_SET(depth_max, depth);
+    }
+    STAT_ADD(samples, 1);
+}
+
+/*
+ * With the latest policy no frame waits in the ring: the next one is
+ * captured once the worker took the last, so it is always the newest
+ * screen. Frames are never dropped on the way, each one is a delta.
+ */
+static int queue_latest(Test *test)
+{
+    return test->queue_policy == QUEUE_POLICY_LATEST;
+}
+
+/*
+ * The worker releases a frame only once every viewer has it, so with
+ * several of them the release latency is the slowest one's. Dropping
+ * frames for the others would lose the changes they carry, every frame
+ * being a delta on the one before. Past lag_latest_ms capture waits
+ * instead until the last frame was released; the engine collects the
+ * changes meanwhile and the next frame carries all of them.
+ */
+static FrameSlot *frame_slot_for_capture(Test *test)
+{
+    int i;
+
+    if (queue_latest(test) && ast_ring_count(&frame_ring) > 0) {
+        return NULL;
+    }
+    if (__atomic_load_n(&test->lagging, __ATOMIC_ACQUIRE)) {
+        for (i = 0; i < test->frame_slots; i++) {
+            if (frame_slot_get_state(&frame_slots[i]) != FRAME_SLOT_FREE) {
+                return NULL;
+            }
+        }
+    }
+    return frame_slot_get_free(test);
+}
+
+static void lag_update(Test *test)
+{
+    int release_ms = __atomic_load_n(&test->pacing.release_us, __ATOMIC_RELAXED) / 1000;
+    int viewers = __atomic_load_n(&test->started, __ATOMIC_RELAXED);
+    gint64 now;
+
+    if (test->lag_latest_ms <= 0 || test->queue_policy == QUEUE_POLICY_LATEST) {
+        return;
+    }
+    now = g_get_monotonic_time();
+    if (!test->lagging && viewers > 1 && release_ms > test->lag_latest_ms) {
+        printf("%s: %d viewers, release %d ms, capturing at the slowest one's pace\n",
+               __func__, viewers, release_ms);
+        STAT_ADD(lag_periods, 1);
+        STAT_SET(lag_since, now);
+        __atomic_store_n(&test->lagging, TRUE, __ATOMIC_RELEASE);
+    } else if (test->lagging && (viewers <= 1 || release_ms < test->lag_latest_ms / 2)) {
+        printf("%s: release %d ms, capturing at full pace\n", __func__, release_ms);
+        STAT_ADD(lag_time, now - STAT_GET(lag_since));
+        STAT_SET(lag_since, 0);
+        __atomic_store_n(&test->lagging, FALSE, __ATOMIC_RELEASE);
+    }
+}
+
+/* time spent lagging so far, a period still going on included */
+static gint64 lag_total_us(gint64 now)
+{
+    gint64 since = STAT_GET(lag_since);
+
+    return STAT_GET(lag_time) + (since ? now - since : 0);
+}
+
+/*
+ * A display client, keyed by connection id in Test.display_links, main
+ * loop only. QXL hands every client the same frames and releases them
+ * once the last one is done, so what can be told per client is what it
+ * went through while connected: the frames delivered, the time the
+ * pipeline lagged and the worst release latency. A viewer that is there
+ * for every lagging period and whose departure ends them is the slow one.
+ */
+typedef struct ViewerLink {
+    uint32_t connection_id;
+    gint64 joined;
+    uint64_t delivered;     /* pipeline_stats.delivered at the join */
+    gint64 lag_us;          /* lag_total_us() at the join */
+    int release_max_us;     /* worst release latency at the stats ticks */
+} ViewerLink;
+
+static void viewer_print(ViewerLink *link, const char *event, gint64 now, int release_us)
+{
+    link->release_max_us = MAX(link->release_max_us, release_us);
+    printf("viewer %u%s: %.1f s, %" PRIu64 " frames, %.1f s at the slowest viewer's pace,"
+           " worst release %.1f ms\n",
+           link->connection_id, event, (now - link->joined) / (double)G_USEC_PER_SEC,
+           STAT_GET(delivered) - link->delivered,
+           (lag_total_us(now) - link->lag_us) / (double)G_USEC_PER_SEC,
+           link->release_max_us / 1000.0);
+}
+
+static void print_stats(void *opaque)
+{
+    Test *test = opaque;
+    gint64 now = g_get_monotonic_time();
+    uint64_t delivered = STAT_GET(delivered);
+    uint64_t samples = STAT_TAKE(samples);
+    double elapsed = (now - pipeline_stats.last_report) / (double)G_USEC_PER_SEC;
+    int release_us = __atomic_load_n(&test->pacing.release_us, __ATOMIC_RELAXED);
+    GHashTableIter iter;
+    gpointer link;
+    gint64 since;
+    int i;
+
+    printf("pipeline: %.1f fps, captured %" PRIu64 " no-change %" PRIu64
+           " delivered %" PRIu64 " released %" PRIu64 " stalled %" PRIu64 "\n",
+           elapsed > 0 ? (delivered - pipeline_stats.last_delivered) / elapsed : 0.0,
+           STAT_GET(captured), STAT_GET(no_change), delivered, STAT_GET(released),
+           STAT_GET(stalled));
+    printf("queue: %s, depth avg %.2f max %u, full %" PRIu64 "\n",
+           queue_latest(test) ? "latest" : "fifo",
+           samples ? STAT_TAKE(depth_sum) / (double)samples : 0.0,
+           STAT_TAKE(depth_max), STAT_GET(ring_full));
+    printf("pipeline: %d slots, occupancy", test->frame_slots);
+    for (i = 0; i < FRAME_SLOT_NSTATES; i++) {
+        uint64_t occupancy = STAT_TAKE(occupancy[i]);
+
+        printf(" %s %.2f", frame_slot_state_names[i],
+               samples ? occupancy / (double)samples : 0.0);
+    }
+    printf("\n");
+    if (test->partial_updates) {
+        uint64_t area = STAT_TAKE(partial_area);
+        uint64_t screen = STAT_TAKE(partial_screen);
+
+        printf("partial: %" PRIu64 " frames, %.1f%% of the screen, %" PRIu64 " unparsed\n",
+               STAT_GET(partial), screen ? 100.0 * area / screen : 0.0,
+               STAT_GET(partial_failed));
+    }
+    printf("mode: %dx%d%s, %" PRIu64 " changes, %" PRIu64 " flaps, %" PRIu64
+           " frames dropped settling, %" PRIu64 " no-signal periods\n",
+           __atomic_load_n(&test->primary_width, __ATOMIC_RELAXED),
+           __atomic_load_n(&test->primary_height, __ATOMIC_RELAXED),
+           __atomic_load_n(&mode_state.no_signal, __ATOMIC_RELAXED) ? " (no signal)" : "",
+           STAT_GET(mode_changes), STAT_GET(mode_flaps),
+           STAT_GET(mode_settling), STAT_GET(no_signal));
+    printf("solid: %" PRIu64 " frames, %" PRIu64 " fills sent, %" PRIu64 " resyncs\n",
+           STAT_GET(solid), STAT_GET(fills), STAT_GET(resync));
+    if (STAT_GET(overflow)) {
+        printf("videocap: %" PRIu64 " frames larger than the mapping dropped\n",
+               STAT_GET(overflow));
+    }
+    if (test->decode_bitmaps) {
+        uint64_t decoded = STAT_TAKE(decoded);
+        uint64_t decode_us = STAT_TAKE(decode_us);
+        uint64_t area = STAT_TAKE(decode_area);
+        uint64_t screen = STAT_TAKE(decode_screen);
+
+        printf("decode: %s, %" PRIu64 " frames, %.2f ms per frame, %.1f%% of the screen,"
+               " %" PRIu64 " failed\n",
+               decoder.simd ? "simd" : "scalar", decoded,
+               decoded ? decode_us / 1000.0 / decoded : 0.0,
+               screen ? 100.0 * area / screen : 0.0,
+               STAT_GET(decode_failed));
+        if (test->image_cache) {
+            uint64_t images = STAT_GET(images_cached);
+            uint64_t hash_us = STAT_TAKE(image_hash_us);
+
+            /* spice doesn't report hits, a repeat is only a chance for one */
+            printf("image cache (bitmap mode only): %" PRIu64 " images tagged, %" PRIu64
+                   " repeating one of the last %d, %.1f us to hash\n",
+                   images, STAT_GET(images_repeated), IMAGE_IDS_RECENT,
+                   images ? hash_us / (double)images : 0.0);
+        }
+    }
+    if (test->mjpeg_stream) {
+        uint64_t frames = STAT_TAKE(stream_frames);
+        uint64_t bytes = STAT_TAKE(stream_bytes);
+
+        printf("stream: %s, %" PRIu64 " frames, %.1f KB avg, %" PRIu64 " dropped, %" PRIu64
+               " incomplete, %" PRIu64 " unparsed\n",
+               __atomic_load_n(&stream_port.started, __ATOMIC_RELAXED) ? "started" : "stopped",
+               frames, frames ? bytes / 1024.0 / frames : 0.0,
+               STAT_GET(stream_dropped), STAT_GET(stream_incomplete),
+               STAT_GET(stream_failed));
+        ast_buf_pool_print(&stream_pool);
+    }
+    printf("viewers: %d, release %.1f ms, %" PRIu64 " keyframes (%" PRIu64 " joins, %" PRIu64
+           " gaps, %" PRIu64 " cache resets, %" PRIu64 " refinements, %" PRIu64
+           " mode changes, %" PRIu64 " stream stops), %" PRIu64
+           " lagging periods (%.1f s)\n",
+           __atomic_load_n(&test->started, __ATOMIC_RELAXED), release_us / 1000.0,
+           STAT_GET(keyframes), STAT_GET(keyframe_reasons[KEYFRAME_CLIENT]),
+           STAT_GET(keyframe_reasons[KEYFRAME_GAP]),
+           STAT_GET(keyframe_reasons[KEYFRAME_CACHE_RESET]),
+           STAT_GET(keyframe_reasons[KEYFRAME_REFINE]),
+           STAT_GET(keyframe_reasons[KEYFRAME_MODE]),
+           STAT_GET(keyframe_reasons[KEYFRAME_STREAM]), STAT_GET(lag_periods),
+           lag_total_us(now) / (double)G_USEC_PER_SEC);
+    g_hash_table_iter_init(&iter, test->display_links);
+    while (g_hash_table_iter_next(&iter, NULL, &link)) {
+        viewer_print(link, "", now, release_us);
+    }
+    if (test->dedupe) {
+        uint64_t hashed = STAT_TAKE(hashed);
+        uint64_t hash_us = STAT_TAKE(hash_us);
+
+        printf("dedupe: %" PRIu64 " frames hashed, %.1f us per frame, %" PRIu64
+               " identical dropped (%.1f KB), %" PRIu64 " identical kept for pass 2\n",
+               hashed, hashed ? hash_us / (double)hashed : 0.0,
+               STAT_GET(dup_frames), STAT_GET(dup_bytes) / 1024.0, STAT_GET(dup_kept));
+    }
+    since = STAT_GET(park_since);
+    printf("capture: %s, %" PRIu64 " parked periods (%.1f s), %" PRIu64
+           " resumes (%" PRIu64 " from the last frame), connect to pixels %.1f ms,"
+           " worst %.1f ms\n",
+           __atomic_load_n(&test->engine_running, __ATOMIC_RELAXED) ? "running" : "parked",
+           STAT_GET(parks),
+           (STAT_GET(park_time) + (since ? now - since : 0)) / (double)G_USEC_PER_SEC,
+           STAT_GET(resumes), STAT_GET(instant_frames),
+           STAT_GET(first_frame_us) / 1000.0, STAT_GET(first_frame_us_max) / 1000.0);
+    ast_deadline_print(&test->deadline_capture);
+    ast_deadline_print(&test->deadline_cursor);
+    ast_deadline_print(&test->deadline_input);
+    ast_watchdog_print(&test->watchdog);
+    ast_pacing_print(&test->pacing);
+    if (test->engine_config_valid) {
+        ast_compress_print(&test->compress);
+    }
+    ast_budget_print(&test->budget);
+    ast_buf_pool_print(&payload_pool);
+    ast_pool_print(&cursor_pool);
+    pipeline_stats.last_delivered = delivered;
+    pipeline_stats.last_report = now;
+
+    test->core->timer_start(test->stats_timer, test->stats_interval * 1000);
+}
+
+static void partial_mark(const AstBlock *block, SPICE_GNUC_UNUSED void *opaque)
+{
+    partial_map.dirty[block->y * partial_map.mbw + block->x] = 1;
+}
+
+/*
+ * Find the area covered by the blocks of a frame that only carries the
+ * macroblocks the engine saw change. Runs of dirty macroblocks on a row
+ * extend the rect ending right above them when the columns match, so a
+ * changed window becomes a single rect. Returns the number of rects, 0 if
+ * there are more than PARTIAL_RECTS_MAX (bbox is still valid) and -1 if
+ * the frame can't be used as a partial update.
+ */
+static int partial_update_rects(Test *test, const struct ASTHeader *hdr,
+                                const uint8_t *data, uint32_t size,
+                                QXLRect *rects, QXLRect *bbox)
+{
+    AstStreamInfo info = {
+        .width = test->primary_width,
+        .height = test->primary_height,
+        .mode420 = hdr->mode420,
+    };
+    int mb = ast_stream_mb_size(&info);
+    int n = 0, overflow = FALSE;
+    int x, y, i;
+
+    partial_map.mbw = (info.width + mb - 1) / mb;
+    partial_map.mbh = (info.height + mb - 1) / mb;
+    if (hdr->num_of_MB <= 0 || hdr->num_of_MB >= partial_map.mbw * partial_map.mbh) {
+        return -1;
+    }
+
+    memset(partial_map.dirty, 0, partial_map.mbw * partial_map.mbh);
+    if (ast_stream_walk(&info, data, size, partial_mark, NULL, NULL) < 0) {
+        STAT_ADD(partial_failed, 1);
+        return -1;
+    }
+
+    bbox->left = info.width;
+    bbox->top = info.height;
+    bbox->right = 0;
+    bbox->bottom = 0;
+    for (y = 0; y < partial_map.mbh; y++) {
+        uint8_t *row = partial_map.dirty + y * partial_map.mbw;
+        QXLRect r;
+
+        for (x = 0; x < partial_map.mbw; x++) {
+            if (!row[x]) {
+                continue;
+            }
+            r.left = x * mb;
+            while (x < partial_map.mbw && row[x]) {
+                x++;
+            }
+            r.right = MIN(x * mb, info.width);
+            r.top = y * mb;
+            r.bottom = MIN(r.top + mb, info.height);
+
+            bbox->left = MIN(bbox->left, r.left);
+            bbox->top = MIN(bbox->top, r.top);
+            bbox->right = MAX(bbox->right, r.right);
+            bbox->bottom = MAX(bbox->bottom, r.bottom);
+
+            for (i = 0; i < n; i++) {
+                if (rects[i].left == r.left && rects[i].right == r.right &&
+                    rects[i].bottom == r.top) {
+                    rects[i].bottom = r.bottom;
+                    break;
+                }
+            }
+            if (i == n) {
+                if (n < PARTIAL_RECTS_MAX) {
+                    rects[n++] = r;
+                } else {
+                    overflow = TRUE;
+                }
+            }
+        }
+    }
+    if (bbox->right <= bbox->left) {
+        return -1;
+    }
+    return overflow ? 0 : n;
+}
+
+/*
+ * During POST and OS boot the source mode flaps a lot; only recreate the
+ * primary once a new mode has been reported for mode_debounce_ms. Frames
+ * in the new mode are dropped until then, so the first one after the
+ * resize must be a full frame.
+ */
+static int mode_settled(Test *test, int width, int height)
+{
+    gint64 now = g_get_monotonic_time();
+
+    if (width != mode_state.width || height != mode_state.height) {
+        if (mode_state.width >= 0) {
+            STAT_ADD(mode_flaps, 1);
+        }
+        mode_state.width = width;
+        mode_state.height = height;
+        mode_state.since = now;
+    }
+    if (now - mode_state.since < test->mode_debounce_ms * 1000) {
+        STAT_ADD(mode_settling, 1);
+        return FALSE;
+    }
+    mode_state.width = -1;
+    mode_state.height = -1;
+    return TRUE;
+}
+
+/* a pending mode is due but a static screen sends no frame to apply it with */
+static int mode_overdue(Test *test, gint64 now)
+{
+    return mode_state.width >= 0 &&
+           now - mode_state.since >= test->mode_debounce_ms * 1000;
+}
+
+static void mode_cancel(void)
+{
+    if (mode_state.width >= 0) {
+        STAT_ADD(mode_flaps, 1);
+        mode_state.width = -1;
+        mode_state.height = -1;
+    }
+}
+
+/* the client may not have the last frame, or it is about to be replaced */
+static void frame_dedupe_reset(void)
+{
+    frame_dedupe.valid = FALSE;
+}
+
+/* a solid fill over the whole primary */
+static SimpleSpiceUpdate *fill_update(Test *test, uint32_t surface_id, FrameSlot *slot,
+                                      uint32_t color)
+{
+    SimpleSpiceUpdate *update = &slot->update;
+    QXLDrawable *drawable = &fill_cache.drawable;
+
+    frame_dedupe_reset();
+
+    if (fill_cache.width != test->primary_width ||
+        fill_cache.height != test->primary_height ||
+        fill_cache.color != color) {
+        fill_cache.width = test->primary_width;
+        fill_cache.height = test->primary_height;
+        fill_cache.color = color;
+
+        memset(drawable, 0, sizeof(*drawable));
+        drawable->bbox.right = test->primary_width;
+        drawable->bbox.bottom = test->primary_height;
+        drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+        drawable->effect = QXL_EFFECT_OPAQUE;
+        drawable->type = QXL_DRAW_FILL;
+        drawable->surfaces_dest[0] = -1;
+        drawable->surfaces_dest[1] = -1;
+        drawable->surfaces_dest[2] = -1;
+        drawable->u.fill.brush.type = SPICE_BRUSH_TYPE_SOLID;
+        drawable->u.fill.brush.u.color = color;
+        drawable->u.fill.rop_descriptor = SPICE_ROPD_OP_PUT;
+    }
+
+    memset(update, 0, sizeof(*update));
+    update->drawable = *drawable;
+    update->drawable.surface_id = surface_id;
+    update->drawable.release_info.id = (intptr_t)update;
+
+    update->ext.cmd.type = QXL_CMD_DRAW;
+    update->ext.cmd.data = (intptr_t)&update->drawable;
+    update->ext.group_id = MEM_SLOT_GROUP_ID;
+    slot->size = sizeof(update->drawable);
+
+    STAT_ADD(fills, 1);
+    solid_state.active = TRUE;
+    solid_state.color = color;
+    solid_state.need_full_frame = TRUE;
+    return update;
+}
+
+/*
+ * A blank or single color screen: send the fill once and back off to the
+ * idle capture rate for as long as it stays that way.
+ */
+static SimpleSpiceUpdate *solid_update(Test *test, uint32_t surface_id, FrameSlot *slot,
+                                       uint32_t color)
+{
+    STAT_ADD(solid, 1);
+    ast_pacing_idle(&test->pacing);
+    if (solid_state.active && solid_state.color == color) {
+        return NULL;
+    }
+    return fill_update(test, surface_id, slot, color);
+}
+
+static int frame_mb_count(Test *test, const struct ASTHeader *hdr)
+{
+    AstStreamInfo info = {
+        .width = test->primary_width,
+        .height = test->primary_height,
+        .mode420 = hdr->mode420,
+    };
+    int mb = ast_stream_mb_size(&info);
+
+    return ((info.width + mb - 1) / mb) * ((info.height + mb - 1) / mb);
+}
+
+typedef struct SolidScan {
+    int solid;
+    int blocks;
+    uint32_t color;         /* YCbCr */
+} SolidScan;
+
+static void solid_scan_block(const AstBlock *block, void *opaque)
+{
+    SolidScan *scan = opaque;
+    uint32_t color;
+    int i;
+
+    if (!scan->solid) {
+        return;
+    }
+    if (block->kind != AST_BLOCK_KIND_VQ) {
+        scan->solid = FALSE;
+        return;
+    }
+    color = block->vq_color[block->vq_index[0]];
+    for (i = 1; i < 64; i++) {
+        if (block->vq_color[block->vq_index[i]] != color) {
+            scan->solid = FALSE;
+            return;
+        }
+    }
+    if (scan->blocks++ == 0) {
+        scan->color = color;
+    } else if (color != scan->color) {
+        scan->solid = FALSE;
+    }
+}
+
+/*
+ * The engine codes flat areas as single color VQ blocks, about a byte
+ * each, so a full frame that small is worth checking for a single color.
+ */
+static int frame_is_solid(Test *test, const struct ASTHeader *hdr,
+                          const uint8_t *data, uint32_t size, uint32_t *rgb)
+{
+    AstStreamInfo info = {
+        .width = test->primary_width,
+        .height = test->primary_height,
+        .mode420 = hdr->mode420,
+    };
+    int total = frame_mb_count(test, hdr);
+    SolidScan scan = { TRUE, 0, 0 };
+
+    if (hdr->num_of_MB < total || size > (uint32_t)total + 64) {
+        return FALSE;
+    }
+    if (ast_stream_walk(&info, data, size, solid_scan_block, &scan, NULL) < 0 ||
+        !scan.solid || scan.blocks < total) {
+        return FALSE;
+    }
+    *rgb = ast_stream_vq_rgb(scan.color);
+    return TRUE;
+}
+
+static void dedupe_scan_block(const AstBlock *block, void *opaque)
+{
+    if (block->kind == AST_BLOCK_KIND_JPEG_PASS2) {
+        *(int *)opaque = TRUE;
+    }
+}
+
+/*
+ * The engine sometimes reports a change with the very payload it sent
+ * last, e.g. for noise below its threshold. Applying the same blocks
+ * again leaves the screen as it is, so such a frame is dropped before it
+ * is copied and queued. Pass 2 blocks refine the pixels already there,
+ * so frames with them are always sent.
+ */
+static int frame_is_duplicate(Test *test, const struct ASTHeader *hdr,
+                              const uint8_t *data, uint32_t size)
+{
+    gint64 start = g_get_monotonic_time();
+    uint64_t hash = ast_hash64(data, size, 0);
+    AstStreamInfo info = {
+        .width = test->primary_width,
+        .height = test->primary_height,
+        .mode420 = hdr->mode420,
+    };
+    int same, pass2 = FALSE;
+
+    STAT_ADD(hashed, 1);
+    STAT_ADD(hash_us, g_get_monotonic_time() - start);
+
+    same = frame_dedupe.valid && frame_dedupe.hash == hash && frame_dedupe.size == size &&
+           frame_dedupe.width == info.width && frame_dedupe.height == info.height &&
+           frame_dedupe.mode420 == hdr->mode420 && frame_dedupe.jpeg_table == hdr->jpeg_table &&
+           frame_dedupe.adv_table == hdr->adv_table;
+    if (same) {
+        if (ast_stream_walk(&info, data, size, dedupe_scan_block, &pass2, NULL) == 0 && !pass2) {
+            STAT_ADD(dup_frames, 1);
+            STAT_ADD(dup_bytes, size);
+            return TRUE;
+        }
+        STAT_ADD(dup_kept, 1);
+    }
+
+    frame_dedupe.valid = TRUE;
+    frame_dedupe.hash = hash;
+    frame_dedupe.size = size;
+    frame_dedupe.width = info.width;
+    frame_dedupe.height = info.height;
+    frame_dedupe.mode420 = hdr->mode420;
+    frame_dedupe.jpeg_table = hdr->jpeg_table;
+    frame_dedupe.adv_table = hdr->adv_table;
+    return FALSE;
+}
+
+static int engine_command(Test *test, int opcode)
+{
+    ASTCap_Ioctl ioc;
+
+    bzero(&ioc, sizeof(ioc));
+    ioc.OpCode = opcode;
+    if (ioctl(test->videocap_fd, ASTCAP_IOCCMD, &ioc) < 0 ||
+        ioc.ErrCode != ASTCAP_IOCTL_SUCCESS) {
+        return -1;
+    }
+    return 0;
+}
+
+static void engine_clear_buffers(Test *test)
+{
+    frame_dedupe_reset();
+    frame_nums.valid = FALSE;
+    engine_command(test, ASTCAP_IOCTL_CLEAR_BUFFERS);
+}
+
+/*
+ * Ask for a full frame: the engine drops its reference and sends every
+ * macroblock with the next frame, capture itself goes on. Any thread,
+ * requests until the next capture are served by one full frame.
+ */
+static void request_keyframe(Test *test, int reason)
+{
+    __atomic_fetch_or(&test->keyframe_request, 1 << reason, __ATOMIC_RELEASE);
+}
+
+/* capture side, before GET_VIDEO */
+static void keyframe_serve(Test *test)
+{
+    int reasons = __atomic_exchange_n(&test->keyframe_request, 0, __ATOMIC_ACQUIRE);
+    int i;
+
+    if (reasons == 0) {
+        return;
+    }
+    for (i = 0; i < KEYFRAME_REASONS; i++) {
+        if (reasons & (1 << i)) {
+            STAT_ADD(keyframe_reasons[i], 1);
+        }
+    }
+    STAT_ADD(keyframes, 1);
+    engine_clear_buffers(test);
+}
+
+/*
+ * The engine numbers the frames it compresses; a frame we never fetched
+ * took the changes the next one is based on. Unchanged polls may or may
+ * not take a number, so they widen the step allowed.
+ */
+static int frame_num_gap(int frame_num)
+{
+    int gap = frame_nums.valid &&
+              frame_num - frame_nums.frame_num > 1 + frame_nums.no_change;
+
+    frame_nums.valid = TRUE;
+    frame_nums.frame_num = frame_num;
+    frame_nums.no_change = 0;
+    return gap;
+}
+
+static int engine_config_ioctl(Test *test, int opcode, ast_videocap_engine_config_t *config);
+
+/*
+ * Take the recovery step the watchdog asked for. Only the engine is
+ * touched: the surface and the spice sessions stay as they are, and the
+ * cleared buffers make the next frame a full one for every client.
+ */
+static void engine_recover(Test *test, AstWatchdogStep step)
+{
+    switch (step) {
+    case AST_WATCHDOG_NONE:
+        return;
+    case AST_WATCHDOG_CLEAR:
+        break;
+    case AST_WATCHDOG_RESTART:
+        engine_command(test, ASTCAP_IOCTL_STOP_CAPTURE);
+        if (engine_command(test, ASTCAP_IOCTL_START_CAPTURE) < 0) {
+            printf("%s: START_CAPTURE failed\n", __func__);
+        }
+        break;
+    default:
+        if (engine_command(test, ASTCAP_IOCTL_RESET_VIDEOENGINE) < 0) {
+            printf("%s: RESET_VIDEOENGINE failed\n", __func__);
+        }
+        /* the reset loses the quality the controller picked */
+        if (test->engine_config_valid &&
+            engine_config_ioctl(test, ASTCAP_IOCTL_SET_VIDEOENGINE_CONFIGS,
+                                &test->engine_config) < 0) {
+            printf("%s: SET_VIDEOENGINE_CONFIGS failed\n", __func__);
+        }
+        if (engine_command(test, ASTCAP_IOCTL_START_CAPTURE) < 0) {
+            printf("%s: START_CAPTURE failed\n", __func__);
+        }
+        break;
+    }
+    engine_clear_buffers(test);
+}
+
+/* content address of a decoded bitmap, see image_ids */
+static void image_cache_tag(QXLImage *image, const uint8_t *pixels, uint32_t width,
+                            uint32_t height)
+{
+    gint64 start = g_get_monotonic_time();
+    uint64_t id;
+    int i;
+
+    /* all 64 bits keep collisions out of reach, the top one keeps the id
+     * apart from the ids of spice's own image groups */
+    id = ast_hash64(pixels, (size_t)width * height * 4,
+                    ((uint64_t)width << 32) | height) | (1ULL << 63);
+    image->descriptor.id = id;
+    image->descriptor.flags = QXL_IMAGE_CACHE;
+
+    STAT_ADD(images_cached, 1);
+    STAT_ADD(image_hash_us, g_get_monotonic_time() - start);
+    for (i = 0; i < IMAGE_IDS_RECENT; i++) {
+        if (image_ids.ids[i] == id) {
+            STAT_ADD(images_repeated, 1);
+            return;
+        }
+    }
+    image_ids.ids[image_ids.next] = id;
+    image_ids.next = (image_ids.next + 1) % IMAGE_IDS_RECENT;
+}
+
+/*
+ * Decode the frame on our side and send the area it touched as a plain
+ * 32-bit bitmap, for clients without an AST decoder.
+ */
+static SimpleSpiceUpdate *bitmap_update(Test *test, uint32_t surface_id, FrameSlot *slot,
+                                        const struct ASTHeader *hdr,
+                                        const uint8_t *data, size_t size)
+{
+    AstDecodeParams params = {
+        .info = {
+            .width = test->primary_width,
+            .height = test->primary_height,
+            .mode420 = hdr->mode420,
+        },
+        .jpeg_table = hdr->jpeg_table,
+        .adv_table = hdr->adv_table,
+    };
+    SimpleSpiceUpdate *update = &slot->update;
+    QXLDrawable *drawable = &update->drawable;
+    QXLImage *image = &update->image;
+    gint64 start = g_get_monotonic_time();
+    AstDecodeRect dirty;
+    uint32_t bw, bh;
+
+    if (ast_decoder_resize(&decoder, params.info.width, params.info.height) < 0) {
+        return NULL;
+    }
+    if (ast_decode_frame(&decoder, &params, data, size, &dirty) < 0) {
+        /* the planes no longer match the engine's reference frame */
+        STAT_ADD(decode_failed, 1);
+        engine_clear_buffers(test);
+        return NULL;
+    }
+    bw = dirty.right - dirty.left;
+    bh = dirty.bottom - dirty.top;
+    if (bw == 0 || bh == 0) {
+        return NULL;
+    }
+    slot->buf = ast_buf_pool_get(&payload_pool, bw * bh * 4);
+    if (slot->buf == NULL) {
+        /* the client misses this area, start over from a full frame */
+        engine_clear_buffers(test);
+        return NULL;
+    }
+    ast_decode_rgb(&decoder, &dirty, (uint32_t *)slot->buf, bw);
+
+    STAT_ADD(decoded, 1);
+    STAT_ADD(decode_us, g_get_monotonic_time() - start);
+    STAT_ADD(decode_area, (uint64_t)bw * bh);
+    STAT_ADD(decode_screen, (uint64_t)test->primary_width * test->primary_height);
+
+    memset(update, 0, sizeof(*update));
+    update->bitmap = slot->buf;
+
+    drawable->surface_id = surface_id;
+    drawable->bbox.left = dirty.left;
+    drawable->bbox.top = dirty.top;
+    drawable->bbox.right = dirty.right;
+    drawable->bbox.bottom = dirty.bottom;
+    drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+    drawable->effect = QXL_EFFECT_OPAQUE;
+    drawable->release_info.id = (intptr_t)update;
+    drawable->type = QXL_DRAW_COPY;
+    drawable->surfaces_dest[0] = -1;
+    drawable->surfaces_dest[1] = -1;
+    drawable->surfaces_dest[2] = -1;
+
+    drawable->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
+    drawable->u.copy.src_bitmap = (intptr_t)image;
+    drawable->u.copy.src_area.right = bw;
+    drawable->u.copy.src_area.bottom = bh;
+
+    if (test->image_cache) {
+        image_cache_tag(image, slot->buf, bw, bh);
+    } else {
+        QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE, unique);
+    }
+    image->descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
+    image->bitmap.flags = QXL_BITMAP_DIRECT | QXL_BITMAP_TOP_DOWN;
+    image->bitmap.stride = bw * 4;
+    image->descriptor.width = image->bitmap.x = bw;
+    image->descriptor.height = image->bitmap.y = bh;
+    image->bitmap.data = (intptr_t)slot->buf;
+    image->bitmap.palette = 0;
+    image->bitmap.format = SPICE_BITMAP_FMT_32BIT;
+
+    update->ext.cmd.type = QXL_CMD_DRAW;
+    update->ext.cmd.data = (intptr_t)drawable;
+    update->ext.group_id = MEM_SLOT_GROUP_ID;
+    slot->size = size;
+    return update;
+}
+
+static uint8_t *stream_msg_header(uint8_t *p, int type, uint32_t size)
+{
+    StreamDevHeader hdr = {
+        .protocol_version = STREAM_DEVICE_PROTOCOL,
+        .type = GUINT16_TO_LE(type),
+        .size = GUINT32_TO_LE(size),
+    };
+
+    memcpy(p, &hdr, sizeof(hdr));
+    return p + sizeof(hdr);
+}
+
+/*
+ * Rewrap the frame for the stream port. Every frame goes into the
+ * coefficient cache, even with no client, so the stream can start from a
+ * full picture. Returns TRUE if the stream carries the screen.
+ */
+static int stream_frame(Test *test, const struct ASTHeader *hdr)
+{
+    AstDecodeParams params = {
+        .info = {
+            .width = test->primary_width,
+            .height = test->primary_height,
+            .mode420 = hdr->mode420,
+        },
+        .jpeg_table = hdr->jpeg_table,
+        .adv_table = hdr->adv_table,
+    };
+    StreamMsg *msg;
+    const uint8_t *jpeg;
+    size_t len, size;
+    uint8_t *p;
+    int format;
+    int ret;
+
+    ret = ast_mjpeg_update(&stream_port.mjpeg, &params,
+                           (uint8_t *)test->mmap + test->layout.data_offset, test->capture.ioc.Size);
+    if (ret < 0) {
+        /* the cache no longer matches the engine's reference frame */
+        STAT_ADD(stream_failed, 1);
+        ast_mjpeg_invalidate(&stream_port.mjpeg);
+    }
+    if (!__atomic_load_n(&stream_port.started, __ATOMIC_ACQUIRE)) {
+        return FALSE;
+    }
+    if (ret <= 0) {
+        /* ask for a full frame once per cache reset */
+        STAT_ADD(stream_incomplete, 1);
+        if (ret < 0 || stream_port.cleared != stream_port.mjpeg.resets) {
+            stream_port.cleared = stream_port.mjpeg.resets;
+            engine_clear_buffers(test);
+        }
+        return TRUE;
+    }
+
+    if (__atomic_exchange_n(&stream_port.restart, FALSE, __ATOMIC_ACQUIRE)) {
+        stream_port.format_width = 0;
+    }
+    format = stream_port.format_width != test->primary_width ||
+             stream_port.format_height != test->primary_height;
+
+    len = ast_mjpeg_encode(&stream_port.mjpeg, &jpeg);
+    size = sizeof(StreamDevHeader) + len;
+    if (format) {
+        size += sizeof(StreamDevHeader) + sizeof(StreamMsgFormat);
+    }
+    msg = ast_buf_pool_get(&stream_pool, sizeof(StreamMsg) + size);
+    if (len == 0 || msg == NULL) {
+        STAT_ADD(stream_dropped, 1);
+        return TRUE;
+    }
+
+    p = msg->data;
+    if (format) {
+        StreamMsgFormat fmt = {
+            .width = GUINT32_TO_LE(test->primary_width),
+            .height = GUINT32_TO_LE(test->primary_height),
+            .codec = SPICE_VIDEO_CODEC_TYPE_MJPEG,
+        };
+
+        p = stream_msg_header(p, STREAM_TYPE_FORMAT, sizeof(fmt));
+        memcpy(p, &fmt, sizeof(fmt));
+        p += sizeof(fmt);
+    }
+    p = stream_msg_header(p, STREAM_TYPE_DATA, len);
+    memcpy(p, jpeg, len);
+    msg->len = size;
+
+    if (!ast_ring_push(&stream_port.ring, msg)) {
+        ast_buf_pool_put(&stream_pool, msg);
+        STAT_ADD(stream_dropped, 1);
+        return TRUE;
+    }
+    ast_budget_charge(&test->budget, size);
+    if (format) {
+        stream_port.format_width = test->primary_width;
+        stream_port.format_height = test->primary_height;
+    }
+    STAT_ADD(stream_frames, 1);
+    STAT_ADD(stream_bytes, len);
+    if (write(stream_port.event, &(uint64_t){ 1 }, sizeof(uint64_t)) < 0) {
+        /* counter saturated, the main loop is awake anyway */
+    }
+    return TRUE;
+}
+
+/* the returned update lives in slot, it is recycled by release_resource() */
+SimpleSpiceUpdate *test_spice_create_update_from_bitmap(Test *test, uint32_t surface_id,
+                                                        FrameSlot *slot)
 {
     SimpleSpiceUpdate *update;
     QXLDrawable *drawable;
     QXLImage *image;
     uint32_t bw, bh;
+    QXLRect rects[PARTIAL_RECTS_MAX];
+    int nrects = -1;
 #if (_VAR1) && !(_VAR1_1)
     void *bitmap = NULL;
 #else
     uint8_t bitmap[128];
 #endif
     struct ASTHeader *hdr;
+    int no_signal;
+    uint32_t solid_color;
+    gint64 now;
+    AstWatchdogStep step;
     static int i =0;
 
-    bzero(&test->ioc, sizeof(ASTCap_Ioctl));
-    test->ioc.OpCode = ASTCAP_IOCTL_GET_VIDEO;
-    ioctl(test->videocap_fd, ASTCAP_IOCCMD, &test->ioc);
+    keyframe_serve(test);
 
-    if (test->ioc.ErrCode == ASTCAP_IOCTL_NO_VIDEO_CHANGE) {
+    bzero(&test->capture.ioc, sizeof(ASTCap_Ioctl));
+    test->capture.ioc.OpCode = ASTCAP_IOCTL_GET_VIDEO;
+    if (ioctl(test->videocap_fd, ASTCAP_IOCCMD, &test->capture.ioc) < 0) {
+        test->capture.ioc.ErrCode = ASTCAP_IOCTL_ERROR;
+    }
+    now = g_get_monotonic_time();
+
+    if (test->capture.ioc.ErrCode == ASTCAP_IOCTL_ERROR) {
+        ast_pacing_capture(&test->pacing, FALSE, 0);
+        engine_recover(test, ast_watchdog_update(&test->watchdog, now,
+                                                 AST_WATCHDOG_FAILED, 0, 0));
+        return NULL;
+    }
+    if (test->capture.ioc.ErrCode == ASTCAP_IOCTL_NO_VIDEO_CHANGE) {
+        STAT_ADD(no_change, 1);
+        frame_nums.no_change++;
+        ast_pacing_capture(&test->pacing, FALSE, 0);
+        ast_watchdog_update(&test->watchdog, now, AST_WATCHDOG_UNCHANGED, 0, 0);
+        if (mode_overdue(test, now)) {
+            /* the full frame this gets goes through the mode check below */
+            request_keyframe(test, KEYFRAME_MODE);
+        }
         return NULL;
     }
+    if (test->capture.ioc.ErrCode == ASTCAP_IOCTL_BLANK_SCREEN) {
+        ast_watchdog_update(&test->watchdog, now, AST_WATCHDOG_UNCHANGED, 0, 0);
+        return solid_update(test, surface_id, slot, BLANK_COLOR);
+    }
+    if (test->capture.ioc.Size > test->layout.size - test->layout.data_offset ||
+        (uint32_t)((struct ASTHeader *)test->mmap)->comp_size >
+        test->layout.size - test->layout.data_offset) {
+        /* the frame runs past the mapping, the driver's buffer is larger
+         * than what was mapped or the layout is wrong */
+        if (STAT_ADD(overflow, 1) == 1) {
+            printf("%s: %lu byte frame does not fit the mapping, see --videocap-layout\n",
+                   __func__, test->capture.ioc.Size);
+        }
+        engine_clear_buffers(test);
+        engine_recover(test, ast_watchdog_update(&test->watchdog, now,
+                                                 AST_WATCHDOG_FAILED, 0, 0));
+        return NULL;
+    }
+    step = ast_watchdog_update(&test->watchdog, now, AST_WATCHDOG_FRAME,
+                               ((struct ASTHeader *)test->mmap)->frame_num,
+                               ((struct ASTHeader *)test->mmap)->comp_size);
+    if (step != AST_WATCHDOG_NONE) {
+        /* the frame is a stale one, the recovered engine sends a full one next */
+        engine_recover(test, step);
+        return NULL;
+    }
+    if (frame_num_gap(((struct ASTHeader *)test->mmap)->frame_num)) {
+        /* this frame's changes are relative to one the clients never got */
+        request_keyframe(test, KEYFRAME_GAP);
+        ast_pacing_capture(&test->pacing, TRUE, test->capture.ioc.Size);
+        return NULL;
+    }
+    ast_pacing_capture(&test->pacing, TRUE, test->capture.ioc.Size);
+    ast_compress_capture(&test->compress, test->capture.ioc.Size);
 
 #if 0
     // Local testing
     if (i++ >= 1) {
-        test->ioc.ErrCode=  ASTCAP_IOCTL_NO_VIDEO_CHANGE;
+        test->capture.ioc.ErrCode=  ASTCAP_IOCTL_NO_VIDEO_CHANGE;
      } else {
-        test->ioc.Size = 55844;
+        test->capture.ioc.Size = 55844;
     }
 #endif
-    if (test->ioc.ErrCode == ASTCAP_IOCTL_NO_VIDEO_CHANGE) {
-        hdr = bitmap = load_frame(&test->ioc.Size);
+    if (test->capture.ioc.ErrCode == ASTCAP_IOCTL_NO_VIDEO_CHANGE) {
+        hdr = bitmap = load_frame(&test->capture.ioc.Size);
+    } else if (!test->dump_frames) {
+        hdr = (struct ASTHeader *)test->mmap;
     } else {
         dump_frame(test->mmap);
         hdr = (struct ASTHeader *)test->mmap;
@@ -189,19 +1525,73 @@ SimpleSpiceUpdate *test_spice_create_update_from_bitmap(Test *test, uint32_t sur
 #if 0
     hdr = (struct ASTHeader *)test->mmap;
 #endif
-//    printf("sz=%d %x\n", test->ioc.Size, hdr->comp_size);
+//    printf("sz=%d %x\n", test->capture.ioc.Size, hdr->comp_size);
 
 //    test->pointer.last_x = hdr->cur_xpos;
 //    test->pointer.last_y = hdr->cur_ypos;
 
-    if (test->primary_width != hdr->src_mode_x ||
-        test->primary_height != hdr->src_mode_y) {
+    no_signal = hdr->src_mode_x == 0 || hdr->src_mode_y == 0;
+    if (no_signal ? !mode_state.no_signal :
+        test->primary_width != hdr->src_mode_x || test->primary_height != hdr->src_mode_y) {
+        if (!mode_settled(test, hdr->src_mode_x, hdr->src_mode_y)) {
+            return NULL;
+        }
+        if (no_signal) {
+            /* keep the last surface, the client has nothing to resync */
+            printf("--> NO SIGNAL\n");
+            __atomic_store_n(&mode_state.no_signal, TRUE, __ATOMIC_RELAXED);
+            STAT_ADD(no_signal, 1);
+            return fill_update(test, surface_id, slot, NO_SIGNAL_COLOR);
+        }
+        __atomic_store_n(&mode_state.no_signal, FALSE, __ATOMIC_RELAXED);
         spice_qxl_destroy_primary_surface(&test->qxl_instance, 0);
         printf("Resize to %dx%d, signal=%d\n", hdr->src_mode_x, hdr->src_mode_y, hdr->input_signal);
         create_primary_surface(test, hdr->src_mode_x, hdr->src_mode_y);
-        if (hdr->src_mode_x == 0 || hdr->src_mode_y == 0) {
-            printf("--> NO SIGNAL\n");
+        STAT_ADD(mode_changes, 1);
+        if (hdr->num_of_MB < frame_mb_count(test, hdr)) {
+            /* the frames dropped while settling never reached the blank
+             * primary, a delta has nothing to apply to */
+            request_keyframe(test, KEYFRAME_MODE);
+            return NULL;
+        }
+    } else {
+        mode_cancel();
+        if (no_signal) {
+            /* the placeholder is already on screen */
+            return NULL;
+        }
+        __atomic_store_n(&mode_state.no_signal, FALSE, __ATOMIC_RELAXED);
+    }
+
+    if (test->dedupe &&
+        frame_is_duplicate(test, hdr, (uint8_t *)test->mmap + test->layout.data_offset,
+                           test->capture.ioc.Size)) {
+        return NULL;
+    }
+
+    if (test->mjpeg_stream && stream_frame(test, hdr)) {
+        return NULL;
+    }
+
+    if (frame_is_solid(test, hdr, (uint8_t *)test->mmap + test->layout.data_offset,
+                       test->capture.ioc.Size, &solid_color)) {
+        return solid_update(test, surface_id, slot, solid_color);
+    }
+    solid_state.active = FALSE;
+    if (solid_state.need_full_frame) {
+        if (hdr->num_of_MB < frame_mb_count(test, hdr)) {
+            /* only the blocks changed since the engine's last frame */
+            STAT_ADD(resync, 1);
+            engine_clear_buffers(test);
+            return NULL;
         }
+        solid_state.need_full_frame = FALSE;
+    }
+
+    if (test->decode_bitmaps) {
+        return bitmap_update(test, surface_id, slot, hdr,
+                             (uint8_t *)test->mmap + test->layout.data_offset,
+                             test->capture.ioc.Size);
     }
 
 #if _VAR1
@@ -212,15 +1602,53 @@ SimpleSpiceUpdate *test_spice_create_update_from_bitmap(Test *test, uint32_t sur
         .bottom = test->primary_height
     };
 //#  if _VAR1_1
+    if (bitmap == NULL && test->zero_copy) {
+        /* The client expects the header right in front of the payload, so
+         * stage it in the unused gap below the payload and hand the mapping
+         * itself to the worker. With a single slot GET_VIDEO is not issued
+         * again until release_resource() frees it. */
+        bitmap = test->mmap + test->layout.data_offset - AST_VIDEOCAP_HDR_SIZE;
+        memcpy(bitmap, test->mmap, AST_VIDEOCAP_HDR_SIZE);
+    }
     if (bitmap == NULL) {
-    bitmap = malloc(test->ioc.Size + 88);
-    memcpy(bitmap, test->mmap, 88);
-    if (test->ioc.ErrCode != ASTCAP_IOCTL_NO_VIDEO_CHANGE) {
-        if (test->ioc.Size > 0)
-            memcpy(bitmap + 88, test->mmap + 0x4000, test->ioc.Size);
+    bitmap = slot->buf = ast_buf_pool_get(&payload_pool,
+                                          test->capture.ioc.Size + AST_VIDEOCAP_HDR_SIZE);
+    if (bitmap == NULL) {
+        /* the clients miss this frame's changes */
+        request_keyframe(test, KEYFRAME_GAP);
+        return NULL;
+    }
+    memcpy(bitmap, test->mmap, AST_VIDEOCAP_HDR_SIZE);
+    if (test->capture.ioc.ErrCode != ASTCAP_IOCTL_NO_VIDEO_CHANGE) {
+        if (test->capture.ioc.Size > 0)
+            memcpy(bitmap + AST_VIDEOCAP_HDR_SIZE, test->mmap + test->layout.data_offset, test->capture.ioc.Size);
     }
     }
 //#  endif
+    if (test->partial_updates && test->capture.ioc.ErrCode != ASTCAP_IOCTL_NO_VIDEO_CHANGE) {
+        nrects = partial_update_rects(test, hdr, (uint8_t *)bitmap + AST_VIDEOCAP_HDR_SIZE,
+                                      test->capture.ioc.Size, rects, &bbox);
+        if (nrects >= 0) {
+            uint64_t area = 0;
+            int i;
+
+            for (i = 0; i < nrects; i++) {
+                area += (uint64_t)(rects[i].right - rects[i].left) *
+                        (rects[i].bottom - rects[i].top);
+            }
+            if (nrects == 0) {
+                area = (uint64_t)(bbox.right - bbox.left) * (bbox.bottom - bbox.top);
+            }
+            STAT_ADD(partial, 1);
+            STAT_ADD(partial_area, area);
+            STAT_ADD(partial_screen, (uint64_t)test->primary_width * test->primary_height);
+        } else {
+            bbox.left = 0;
+            bbox.top = 0;
+            bbox.right = test->primary_width;
+            bbox.bottom = test->primary_height;
+        }
+    }
 
 #else
     QXLRect bbox = {
@@ -233,7 +1661,8 @@ SimpleSpiceUpdate *test_spice_create_update_from_bitmap(Test *test, uint32_t sur
     bh = bbox.bottom - bbox.top;
     bw = bbox.right - bbox.left;
 
-    update   = calloc(sizeof(*update), 1);
+    update   = &slot->update;
+    memset(update, 0, sizeof(*update));
     update->bitmap = bitmap;
     drawable = &update->drawable;
     image    = &update->image;
@@ -242,6 +1671,15 @@ SimpleSpiceUpdate *test_spice_create_update_from_bitmap(Test *test, uint32_t sur
 
     drawable->bbox            = bbox;
     drawable->clip.type       = SPICE_CLIP_TYPE_NONE;
+    if (nrects > 0) {
+        /* the image still decodes to the whole screen, only the changed
+         * area is drawn from it */
+        update->clip_rects.clip.num_rects = nrects;
+        update->clip_rects.clip.chunk.data_size = nrects * sizeof(QXLRect);
+        memcpy(update->clip_rects.rects, rects, nrects * sizeof(QXLRect));
+        drawable->clip.type = SPICE_CLIP_TYPE_RECTS;
+        drawable->clip.data = (intptr_t)&update->clip_rects.clip;
+    }
     drawable->effect          = QXL_EFFECT_OPAQUE;
     drawable->release_info.id = (intptr_t)update;
     drawable->type            = QXL_DRAW_ALPHA_BLEND;
@@ -252,18 +1690,20 @@ SimpleSpiceUpdate *test_spice_create_update_from_bitmap(Test *test, uint32_t sur
     drawable->u.alpha_blend.alpha           = 0xff;
     drawable->u.alpha_blend.alpha_flags     = SPICE_ALPHA_FLAGS_DEST_HAS_ALPHA;
     drawable->u.alpha_blend.src_bitmap      = (intptr_t)image;
-    drawable->u.alpha_blend.src_area.right  = bw;
-    drawable->u.alpha_blend.src_area.bottom = bh;
+    drawable->u.alpha_blend.src_area.left   = bbox.left;
+    drawable->u.alpha_blend.src_area.top    = bbox.top;
+    drawable->u.alpha_blend.src_area.right  = bbox.left + bw;
+    drawable->u.alpha_blend.src_area.bottom = bbox.top + bh;
 
     QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE, unique);
 
 #if _VAR1
     image->descriptor.type   = SPICE_IMAGE_TYPE_AST;
     image->ast.data = (uint8_t *)bitmap;
-    image->ast.data_size = test->ioc.Size + 88;
+    image->ast.data_size = test->capture.ioc.Size + AST_VIDEOCAP_HDR_SIZE;
 
 //    printf("image %p [%x]\n", image->ast.data, image->ast.data_size);
-//    printf("ioc.Size=%x comp=%x bmp=%p (%08x)\n", test->ioc.Size, hdr->comp_size, bitmap, *((int32_t *)bitmap + (88 >> 2)));
+//    printf("ioc.Size=%x comp=%x bmp=%p (%08x)\n", test->capture.ioc.Size, hdr->comp_size, bitmap, *((int32_t *)bitmap + (88 >> 2)));
 
 #else
     image->descriptor.type   = SPICE_IMAGE_TYPE_BITMAP;
@@ -281,6 +1721,7 @@ SimpleSpiceUpdate *test_spice_create_update_from_bitmap(Test *test, uint32_t sur
     update->ext.cmd.padding = 0;
     update->ext.group_id = MEM_SLOT_GROUP_ID;
     update->ext.flags = 0;
+    slot->size = test->capture.ioc.Size;
 //    printf("UP type=%d\n", update->ext.cmd.type);
 
     return update;
@@ -296,148 +1737,710 @@ QXLDevMemSlot slot = {
 .qxl_ram_size = ~0,
 };
 
-static void attache_worker(QXLInstance *qin, QXLWorker *_qxl_worker)
+static void attache_worker(QXLInstance *qin, QXLWorker *_qxl_worker)
+{
+    Test *test = SPICE_CONTAINEROF(qin, Test, qxl_instance);
+
+    if (test->qxl_worker) {
+        if (test->qxl_worker != _qxl_worker)
+            printf("%s ignored, %p is set, ignoring new %p\n", __func__,
+                   test->qxl_worker, _qxl_worker);
+        else
+            printf("%s ignored, redundant\n", __func__);
+        return;
+    }
+    printf("%s\n", __func__);
+    test->qxl_worker = _qxl_worker;
+    spice_qxl_add_memslot(&test->qxl_instance, &slot);
+    create_primary_surface(test, DEFAULT_WIDTH, DEFAULT_HEIGHT);
+    spice_server_vm_start(test->server);
+}
+
+static void set_compression_level(QXLInstance *qin, int level)
+{
+    Test *test = SPICE_CONTAINEROF(qin, Test, qxl_instance);
+
+    printf("%s: %d\n", __func__, level);
+    ast_compress_set_spice_level(&test->compress, level);
+}
+
+static void set_mm_time(SPICE_GNUC_UNUSED QXLInstance *qin,
+                        SPICE_GNUC_UNUSED uint32_t mm_time)
+{
+}
+
+// we now have a secondary surface
+#define MAX_SURFACE_NUM 1
+
+static void get_init_info(SPICE_GNUC_UNUSED QXLInstance *qin,
+                          QXLDevInitInfo *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->num_memslots = 1;
+    info->num_memslots_groups = 1;
+    info->memslot_id_bits = 1;
+    info->memslot_gen_bits = 1;
+    info->n_surfaces = MAX_SURFACE_NUM;
+}
+
+static void capture_kick(Test *test);
+
+// called from spice_server thread (i.e. red_worker thread)
+static int get_command(QXLInstance *qin,
+                       struct QXLCommandExt *ext)
+{
+    Test *test = SPICE_CONTAINEROF(qin, Test, qxl_instance);
+    FrameSlot *slot = ast_ring_pop(&frame_ring);
+    gint64 resume_time;
+    static uint32_t next_seq;
+    static int next_seq_valid;
+
+    if (slot == NULL) {
+        return FALSE;
+    }
+    if (queue_latest(test)) {
+        /* the ring is empty again, capture may take the next frame */
+        capture_kick(test);
+    }
+
+    /* Every frame only carries what changed since the one before, a frame
+     * dropped on the way by a full ring leaves the clients behind */
+    if (next_seq_valid && slot->seq != next_seq) {
+        request_keyframe(test, KEYFRAME_GAP);
+    }
+    next_seq = slot->seq + 1;
+    next_seq_valid = TRUE;
+
+    memcpy(ext, &slot->update.ext, sizeof(*ext));
+//    printf("type=%d %p seq=%u\n", ext->cmd.type, ext, slot->seq);
+    frame_slot_set_state(slot, FRAME_SLOT_IN_FLIGHT);
+    STAT_ADD(delivered, 1);
+    resume_time = __atomic_exchange_n(&test->resume_time, 0, __ATOMIC_RELAXED);
+    if (resume_time) {
+        /* from the first viewer's arrival to its first frame */
+        gint64 first_frame_us = g_get_monotonic_time() - resume_time;
+
+        STAT_SET(first_frame_us, first_frame_us);
+        if (first_frame_us > STAT_GET(first_frame_us_max)) {
+            STAT_SET(first_frame_us_max, first_frame_us);
+        }
+    }
+    return TRUE;
+}
+
+/* the cursor is polled every wakeup_ms, in timer mode frames may be due sooner */
+static int wakeup_interval(Test *test)
+{
+    if (test->capture_mode == CAPTURE_MODE_TIMER) {
+        return MIN(test->wakeup_ms, ast_pacing_interval(&test->pacing));
+    }
+    return test->wakeup_ms;
+}
+
+/* called from the main loop and the worker, the due time is only for the stats */
+static void wakeup_schedule(Test *test, int ms)
+{
+    __atomic_store_n(&test->wakeup_due, g_get_monotonic_time() + ms * 1000,
+                     __ATOMIC_RELAXED);
+    test->core->timer_start(test->wakeup_timer, ms);
+}
+
+static int req_cmd_notification(QXLInstance *qin)
+{
+    Test *test = SPICE_CONTAINEROF(qin, Test, qxl_instance);
+
+    if (test->capture_mode == CAPTURE_MODE_THREAD) {
+        /* the capture thread wakes the worker as soon as it queues a frame;
+         * if one slipped in already let the worker poll again */
+        return ast_ring_count(&frame_ring) == 0;
+    }
+    /* while nobody watches viewers_update() restarts the timer */
+    if (__atomic_load_n(&test->started, __ATOMIC_SEQ_CST)) {
+        wakeup_schedule(test, wakeup_interval(test));
+    }
+    return TRUE;
+}
+
+static int engine_config_ioctl(Test *test, int opcode, ast_videocap_engine_config_t *config)
+{
+    ASTCap_Ioctl ioc;
+
+    bzero(&ioc, sizeof(ioc));
+    ioc.OpCode = opcode;
+    ioc.Size = sizeof(*config);
+    ioc.vPtr = config;
+    if (ioctl(test->videocap_fd, ASTCAP_IOCCMD, &ioc) < 0 ||
+        ioc.ErrCode != ASTCAP_IOCTL_SUCCESS) {
+        return -1;
+    }
+    return 0;
+}
+
+/* start from the driver's settings, only the quality fields are ever changed */
+static void compress_init(Test *test)
+{
+    if (engine_config_ioctl(test, ASTCAP_IOCTL_GET_VIDEOENGINE_CONFIGS,
+                            &test->engine_config) < 0) {
+        printf("%s: GET_VIDEOENGINE_CONFIGS failed, quality stays fixed\n", __func__);
+        return;
+    }
+    test->engine_config_valid = TRUE;
+}
+
+/* feed the controller, reconfigure the engine when the quality level moved */
+static void compress_update(Test *test)
+{
+    const AstQuality *quality;
+
+    if (!test->engine_config_valid ||
+        !ast_compress_update(&test->compress, g_get_monotonic_time(),
+                             __atomic_load_n(&test->pacing.release_us, __ATOMIC_RELAXED))) {
+        return;
+    }
+
+    quality = ast_compress_quality(&test->compress);
+    test->engine_config.dct_quant_tbl_select = quality->jpeg_table;
+    test->engine_config.sharp_quant_tbl_select = quality->adv_table;
+    test->engine_config.compression_mode = quality->mode420 ? AST_ENGINE_YUV420 :
+                                                              AST_ENGINE_YUV444;
+    if (engine_config_ioctl(test, ASTCAP_IOCTL_SET_VIDEOENGINE_CONFIGS,
+                            &test->engine_config) < 0) {
+        printf("%s: SET_VIDEOENGINE_CONFIGS failed\n", __func__);
+    }
+    if (ast_compress_refine_started(&test->compress)) {
+        /* nothing changes on a settled screen, only a full frame redraws it */
+        request_keyframe(test, KEYFRAME_REFINE);
+    }
+}
+
+/*
+ * Take a full frame for the next first viewer before capture parks. With
+ * nobody watching this is also the moment to follow a mode change.
+ */
+static void last_frame_snapshot(Test *test)
+{
+    struct ASTHeader *hdr = (struct ASTHeader *)test->mmap;
+    AstStreamInfo info;
+    size_t size;
+    int mb;
+
+    last_frame.valid = FALSE;
+    if (test->zero_copy && frame_slot_get_free(test) == NULL) {
+        /* the worker may still read the mapping */
+        return;
+    }
+
+    engine_clear_buffers(test);
+    bzero(&test->capture.ioc, sizeof(ASTCap_Ioctl));
+    test->capture.ioc.OpCode = ASTCAP_IOCTL_GET_VIDEO;
+    if (ioctl(test->videocap_fd, ASTCAP_IOCCMD, &test->capture.ioc) < 0 ||
+        test->capture.ioc.ErrCode != ASTCAP_IOCTL_SUCCESS) {
+        return;
+    }
+    size = test->capture.ioc.Size;
+    if (size == 0 || size > test->layout.size - test->layout.data_offset ||
+        hdr->src_mode_x <= 0 || hdr->src_mode_y <= 0 ||
+        hdr->src_mode_x > MAX_WIDTH || hdr->src_mode_y > MAX_HEIGHT) {
+        return;
+    }
+    info.width = hdr->src_mode_x;
+    info.height = hdr->src_mode_y;
+    info.mode420 = hdr->mode420;
+    mb = ast_stream_mb_size(&info);
+    if (hdr->num_of_MB < ((info.width + mb - 1) / mb) * ((info.height + mb - 1) / mb)) {
+        /* not a full frame after all */
+        return;
+    }
+
+    if (size + AST_VIDEOCAP_HDR_SIZE > last_frame.buf_size) {
+        g_free(last_frame.buf);
+        last_frame.buf_size = size + AST_VIDEOCAP_HDR_SIZE;
+        last_frame.buf = g_malloc(last_frame.buf_size);
+    }
+    memcpy(last_frame.buf, test->mmap, AST_VIDEOCAP_HDR_SIZE);
+    memcpy(last_frame.buf + AST_VIDEOCAP_HDR_SIZE,
+           (uint8_t *)test->mmap + test->layout.data_offset, size);
+    last_frame.size = size;
+    last_frame.valid = TRUE;
+
+    if (test->primary_width != hdr->src_mode_x || test->primary_height != hdr->src_mode_y) {
+        mode_cancel();
+        __atomic_store_n(&mode_state.no_signal, FALSE, __ATOMIC_RELAXED);
+        spice_qxl_destroy_primary_surface(&test->qxl_instance, 0);
+        printf("Resize to %dx%d while parked\n", hdr->src_mode_x, hdr->src_mode_y);
+        create_primary_surface(test, hdr->src_mode_x, hdr->src_mode_y);
+        STAT_ADD(mode_changes, 1);
+    }
+}
+
+/* the snapshot as a full screen update, NULL if it no longer fits the primary */
+static SimpleSpiceUpdate *last_frame_update(Test *test, uint32_t surface_id, FrameSlot *slot)
+{
+    const struct ASTHeader *hdr = (const struct ASTHeader *)last_frame.buf;
+    size_t size = last_frame.size + AST_VIDEOCAP_HDR_SIZE;
+    SimpleSpiceUpdate *update = &slot->update;
+    QXLDrawable *drawable = &update->drawable;
+    QXLImage *image = &update->image;
+
+    if (hdr->src_mode_x != test->primary_width || hdr->src_mode_y != test->primary_height) {
+        return NULL;
+    }
+    /* a full frame, whatever the client showed before is replaced */
+    solid_state.active = FALSE;
+    solid_state.need_full_frame = FALSE;
+    if (test->decode_bitmaps) {
+        return bitmap_update(test, surface_id, slot, hdr,
+                             last_frame.buf + AST_VIDEOCAP_HDR_SIZE, last_frame.size);
+    }
+
+    slot->buf = ast_buf_pool_get(&payload_pool, size);
+    if (slot->buf == NULL) {
+        return NULL;
+    }
+    memcpy(slot->buf, last_frame.buf, size);
+
+    memset(update, 0, sizeof(*update));
+    update->bitmap = slot->buf;
+
+    drawable->surface_id = surface_id;
+    drawable->bbox.right = test->primary_width;
+    drawable->bbox.bottom = test->primary_height;
+    drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+    drawable->effect = QXL_EFFECT_OPAQUE;
+    drawable->release_info.id = (intptr_t)update;
+    drawable->type = QXL_DRAW_ALPHA_BLEND;
+    drawable->surfaces_dest[0] = -1;
+    drawable->surfaces_dest[1] = -1;
+    drawable->surfaces_dest[2] = -1;
+
+    drawable->u.alpha_blend.alpha = 0xff;
+    drawable->u.alpha_blend.alpha_flags = SPICE_ALPHA_FLAGS_DEST_HAS_ALPHA;
+    drawable->u.alpha_blend.src_bitmap = (intptr_t)image;
+    drawable->u.alpha_blend.src_area.right = test->primary_width;
+    drawable->u.alpha_blend.src_area.bottom = test->primary_height;
+
+    QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE, unique);
+    image->descriptor.type = SPICE_IMAGE_TYPE_AST;
+    image->ast.data = (uint8_t *)slot->buf;
+    image->ast.data_size = size;
+
+    update->ext.cmd.type = QXL_CMD_DRAW;
+    update->ext.cmd.data = (intptr_t)drawable;
+    update->ext.group_id = MEM_SLOT_GROUP_ID;
+    slot->size = last_frame.size;
+    return update;
+}
+
+/*
+ * Run the engine only while someone watches: stop capture when the last
+ * viewer left, start it again with cleared buffers, so the first frame is
+ * a full one, when a viewer arrives. Capture side only, TRUE while running.
+ */
+static int capture_engine_update(Test *test)
 {
-    Test *test = SPICE_CONTAINEROF(qin, Test, qxl_instance);
+    int viewers = __atomic_load_n(&test->started, __ATOMIC_ACQUIRE);
+    gint64 now = g_get_monotonic_time();
 
-    if (test->qxl_worker) {
-        if (test->qxl_worker != _qxl_worker)
-            printf("%s ignored, %p is set, ignoring new %p\n", __func__,
-                   test->qxl_worker, _qxl_worker);
-        else
-            printf("%s ignored, redundant\n", __func__);
-        return;
+    if (viewers && !test->engine_running) {
+        if (engine_command(test, ASTCAP_IOCTL_START_CAPTURE) < 0) {
+            printf("%s: START_CAPTURE failed\n", __func__);
+        }
+        engine_clear_buffers(test);
+        if (STAT_GET(park_since)) {
+            STAT_ADD(park_time, now - STAT_GET(park_since));
+            STAT_SET(park_since, 0);
+        }
+        STAT_ADD(resumes, 1);
+        last_frame.pending = last_frame.valid;
+        __atomic_store_n(&test->engine_running, TRUE, __ATOMIC_RELAXED);
+    } else if (!viewers && test->engine_running) {
+        last_frame_snapshot(test);
+        engine_command(test, ASTCAP_IOCTL_STOP_CAPTURE);
+        STAT_ADD(parks, 1);
+        STAT_SET(park_since, now);
+        __atomic_store_n(&test->engine_running, FALSE, __ATOMIC_RELAXED);
     }
-    printf("%s\n", __func__);
-    test->qxl_worker = _qxl_worker;
-    spice_qxl_add_memslot(&test->qxl_instance, &slot);
-    create_primary_surface(test, DEFAULT_WIDTH, DEFAULT_HEIGHT);
-    spice_server_vm_start(test->server);
+    return test->engine_running;
 }
 
-static void set_compression_level(SPICE_GNUC_UNUSED QXLInstance *qin,
-                                  SPICE_GNUC_UNUSED int level)
+/* hand a filled slot to the worker and charge the budget, TRUE if it was queued */
+static int frame_queue(Test *test, FrameSlot *slot)
 {
-    printf("%s\n", __func__);
+    /* the worker may own the slot as soon as it is pushed */
+    uint32_t size = slot->size;
+
+    slot->seq = frame_seq++;
+    slot->queued_time = g_get_monotonic_time();
+    STAT_ADD(captured, 1);
+    frame_slot_set_state(slot, FRAME_SLOT_QUEUED);
+    if (!ast_ring_push(&frame_ring, slot)) {
+        STAT_ADD(ring_full, 1);
+        frame_dedupe_reset();
+        frame_slot_recycle(slot);
+        return FALSE;
+    }
+    ast_budget_charge(&test->budget, size);
+    return TRUE;
 }
 
-static void set_mm_time(SPICE_GNUC_UNUSED QXLInstance *qin,
-                        SPICE_GNUC_UNUSED uint32_t mm_time)
+/* grab one frame into a free slot and queue it, TRUE if a frame was queued */
+static int capture_frame(Test *test)
 {
-}
+    FrameSlot *slot = frame_slot_for_capture(test);
+    gint64 now = g_get_monotonic_time();
+    int delay;
+    int queued = FALSE;
+
+    pipeline_sample(test);
+    delay = ast_budget_delay(&test->budget, now, __atomic_load_n(&test->started,
+                                                                 __ATOMIC_RELAXED));
+    if (delay > 0) {
+        /* over budget: skip this frame, the engine keeps its changes for
+         * the next one; capture sleeps until the debt is paid off */
+        test->capture.budget_due = now + delay * 1000;
+        return FALSE;
+    }
+    if (slot == NULL) {
+        /* every slot is still owned by the worker, the latest policy waits
+         * for it to take the last frame, or the slowest viewer has yet to
+         * release it */
+        STAT_ADD(stalled, 1);
+        return FALSE;
+    }
 
-// we now have a secondary surface
-#define MAX_SURFACE_NUM 1
+    if (last_frame.pending) {
+        /* the first viewer gets the last frame while the engine catches up */
+        last_frame.pending = FALSE;
+        frame_slot_set_state(slot, FRAME_SLOT_CAPTURING);
+        if (last_frame_update(test, 0, slot) == NULL) {
+            frame_slot_recycle(slot);
+        } else if (frame_queue(test, slot)) {
+            STAT_ADD(instant_frames, 1);
+            queued = TRUE;
+        }
+        slot = frame_slot_for_capture(test);
+        if (slot == NULL) {
+            return queued;
+        }
+    }
 
-static void get_init_info(SPICE_GNUC_UNUSED QXLInstance *qin,
-                          QXLDevInitInfo *info)
+    frame_slot_set_state(slot, FRAME_SLOT_CAPTURING);
+    if (test_spice_create_update_from_bitmap(test, 0, slot) == NULL) {
+        frame_slot_recycle(slot);
+        compress_update(test);
+        lag_update(test);
+        return queued;
+    }
+    compress_update(test);
+    lag_update(test);
+    return frame_queue(test, slot) || queued;
+}
+
+static void do_wakeup(void *opaque)
 {
-    memset(info, 0, sizeof(*info));
-    info->num_memslots = 1;
-    info->num_memslots_groups = 1;
-    info->memslot_id_bits = 1;
-    info->memslot_gen_bits = 1;
-    info->n_surfaces = MAX_SURFACE_NUM;
+    Test *test = opaque;
+    gint64 now = g_get_monotonic_time();
+    gint64 due = __atomic_load_n(&test->wakeup_due, __ATOMIC_RELAXED);
+
+    /* the main loop also runs the input devices, a late timer means late input */
+    if (due) {
+        ast_deadline_check(&test->deadline_input, due, now);
+    }
+
+    if (!__atomic_load_n(&test->started, __ATOMIC_SEQ_CST)) {
+        /* nobody watches: no cursor polls, no capture, let the timer lapse
+         * until viewers_update() brings it back */
+        __atomic_store_n(&test->wakeup_parked, TRUE, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&test->started, __ATOMIC_SEQ_CST) ||
+            !__atomic_exchange_n(&test->wakeup_parked, FALSE, __ATOMIC_SEQ_CST)) {
+            if (test->capture_mode == CAPTURE_MODE_TIMER) {
+                capture_engine_update(test);
+                test->capture_due = 0;
+            }
+            return;
+        }
+        /* a viewer arrived meanwhile */
+    }
+    __atomic_store_n(&test->cursor.notify, NOTIFY_CURSOR_BATCH, __ATOMIC_RELAXED);
+    __atomic_store_n(&test->cursor.notify_time, now, __ATOMIC_RELAXED);
+
+    /* with a capture thread this timer only drives cursor polling */
+    if (test->capture_mode == CAPTURE_MODE_TIMER) {
+        if (now >= test->capture_due) {
+            if (test->capture_due) {
+                ast_deadline_check(&test->deadline_capture, test->capture_due, now);
+            }
+            if (capture_engine_update(test)) {
+                capture_frame(test);
+            }
+            test->capture_due = MAX(now + ast_pacing_interval(&test->pacing) * 1000,
+                                    test->capture.budget_due);
+        }
+    }
+
+//    printf("--do_wakeup\n");
+    wakeup_schedule(test, wakeup_interval(test));
+    spice_qxl_wakeup(&test->qxl_instance);
 }
 
-#if 0
-int commands_end = 0;
-int commands_start = 0;
-struct QXLCommandExt* commands[1024];
+/*
+ * Capture thread: GET_VIDEO blocks while the engine compresses a frame,
+ * so running it here keeps it off the main loop. Between frames the
+ * thread sleeps in poll() on the videocap fd (if the driver signals new
+ * frames through it) and on capture_event, which release_resource()
+ * kicks when a slot becomes free and get_command() when the latest
+ * policy lets the next frame be captured.
+ */
+#define CAPTURE_SPURIOUS_POLL_MAX 8
+
+#define CAPTURE_WAKE_DEV   (1 << 0)
+#define CAPTURE_WAKE_EVENT (1 << 1)
+
+/* returns a mask of CAPTURE_WAKE_*, 0 on timeout */
+static int capture_wait(Test *test, int wait_for_slot, int timeout_ms)
+{
+    struct pollfd fds[2];
+    int nfds = 0;
+    int wake = 0;
+    uint64_t count;
+
+    fds[nfds].fd = test->capture_event;
+    fds[nfds].events = POLLIN;
+    nfds++;
+    if (!wait_for_slot && test->capture_poll_dev) {
+        fds[nfds].fd = test->videocap_fd;
+        fds[nfds].events = POLLIN | POLLPRI;
+        nfds++;
+    }
 
-#define COMMANDS_SIZE COUNT(commands)
+    if (poll(fds, nfds, timeout_ms) <= 0) {
+        return 0;
+    }
+    if (fds[0].revents & POLLIN) {
+        if (read(test->capture_event, &count, sizeof(count)) < 0) {
+            /* nothing pending, someone else drained it */
+        }
+        wake |= CAPTURE_WAKE_EVENT;
+    }
+    if (nfds > 1 && (fds[1].revents & (POLLIN | POLLPRI))) {
+        wake |= CAPTURE_WAKE_DEV;
+    }
+    return wake;
+}
 
-static void push_command(QXLCommandExt *ext)
+/*
+ * Sleep until the pacing governor wants the next frame. A frame signalled
+ * by the driver or a freed slot ends the wait early, but never before the
+ * governor's minimum interval has passed since the last GET_VIDEO.
+ */
+static int capture_sleep(Test *test, gint64 last, int wait_for_slot)
 {
-    ASSERT(commands_end - commands_start < (int) COMMANDS_SIZE);
-    commands[commands_end % COMMANDS_SIZE] = ext;
-    commands_end++;
-//    printf("push_command[%d] %d = %p\n", commands_end-1, commands_start, ext);
+    /* a new frame or a freed slot are no reason to wake while in debt */
+    gint64 due = MAX(last + ast_pacing_interval(&test->pacing) * 1000,
+                     test->capture.budget_due);
+    gint64 earliest = MAX(last + ast_pacing_min_interval(&test->pacing) * 1000,
+                          test->capture.budget_due);
+    gint64 now;
+    int wake;
+
+    while ((now = g_get_monotonic_time()) < due) {
+        wake = capture_wait(test, wait_for_slot, (due - now + 999) / 1000);
+        if (wake == 0) {
+            continue;
+        }
+        if (wait_for_slot && !(wake & CAPTURE_WAKE_EVENT)) {
+            continue;
+        }
+        now = g_get_monotonic_time();
+        if (now < earliest) {
+            g_usleep(earliest - now);
+        }
+        return wake;
+    }
+    ast_deadline_check(&test->deadline_capture, due, now);
+    return 0;
 }
 
-static struct QXLCommandExt *get_simple_command(void)
+static gpointer capture_thread(gpointer opaque)
 {
-    struct QXLCommandExt *ret = commands[commands_start % COMMANDS_SIZE];
-    ASSERT(commands_start < commands_end);
-    commands_start++;
-    return ret;
+    Test *test = opaque;
+    int wake = 0;
+    int spurious = 0;
+
+    ast_sched_apply(&test->sched_capture, "capture");
+    for (;;) {
+        int was_no_change;
+        uint64_t no_change;
+        gint64 last;
+
+        if (!capture_engine_update(test)) {
+            /* nobody watches, sleep until viewers_update() kicks */
+            capture_wait(test, TRUE, -1);
+            wake = 0;
+            continue;
+        }
+
+        no_change = STAT_GET(no_change);
+        last = g_get_monotonic_time();
+        if (capture_frame(test)) {
+            spurious = 0;
+            spice_qxl_wakeup(&test->qxl_instance);
+        }
+
+        /* the engine had nothing new although poll() said it had:
+         * the driver does not implement poll, fall back to sleeping */
+        was_no_change = STAT_GET(no_change) != no_change;
+        if (was_no_change && (wake & CAPTURE_WAKE_DEV) && test->capture_poll_dev &&
+            ++spurious >= CAPTURE_SPURIOUS_POLL_MAX) {
+            printf("%s: videocap poll() is not event driven, pacing by timer only\n",
+                   __func__);
+            test->capture_poll_dev = FALSE;
+        }
+        wake = capture_sleep(test, last, frame_slot_for_capture(test) == NULL);
+    }
+    return NULL;
 }
 
-static int get_num_commands(void)
+static void capture_kick(Test *test)
 {
-    return commands_end - commands_start;
+    uint64_t one = 1;
+
+    if (test->capture_event >= 0 &&
+        write(test->capture_event, &one, sizeof(one)) < 0) {
+        /* counter saturated, the thread is awake anyway */
+    }
 }
 
-// called from spice_server thread (i.e. red_worker thread)
-static int get_command(SPICE_GNUC_UNUSED QXLInstance *qin,
-                       struct QXLCommandExt *ext)
+static int videocap_try_map(Test *test, int prot, size_t size)
 {
-    if (!test->started) return FALSE;
+    void *p = mmap(NULL, size, prot, MAP_SHARED, test->videocap_fd, 0);
 
-    if (get_num_commands() == 0) {
+    if (p == MAP_FAILED) {
         return FALSE;
     }
-
-//    memcpy(ext, cmd_ext, sizeof(*ext));
-    *ext = *get_simple_command();
-    //printf("type=%d %p t=%d %p [%d]\n", ext->cmd.type, ext, cmd_ext->ext.cmd.type, cmd_ext, commands_start);
+    munmap(p, size);
     return TRUE;
 }
 
-#else
-// called from spice_server thread (i.e. red_worker thread)
-static int get_command(SPICE_GNUC_UNUSED QXLInstance *qin,
-                       struct QXLCommandExt *ext)
+/*
+ * The driver has no call that reports its buffer size, but its mmap()
+ * refuses mappings larger than the buffer: find the largest size it
+ * takes, page granular. A driver that takes anything does not check,
+ * only the default is known to be safe then.
+ */
+static size_t videocap_probe_size(Test *test, int prot)
 {
-    if ((intptr_t)cmd_ext <= 0) {
-        return FALSE;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t lo = 0, hi = AST_VIDEOCAP_MMAP_MAX / page;
+
+    if (videocap_try_map(test, prot, hi * page)) {
+        return 0;
     }
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
 
-    memcpy(ext, cmd_ext, sizeof(*ext));
-//    *ext = *&cmd_ext->ext;
-//    printf("type=%d %p t=%d %p\n", ext->cmd.type, ext, cmd_ext->ext.cmd.type, cmd_ext);
-    cmd_ext = (void *)-1;
-    return TRUE;
+        if (videocap_try_map(test, prot, mid * page)) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo * page;
 }
-#endif
 
-static int req_cmd_notification(QXLInstance *qin)
+/*
+ * Map the capture buffer, with the page tables populated up front so the
+ * first frames don't fault, and size the buffers that hold copies of it.
+ */
+int ast_map_videocap(Test *test)
 {
-    Test *test = SPICE_CONTAINEROF(qin, Test, qxl_instance);
+    /* zero-copy stages the frame header inside the mapping */
+    int prot = test->zero_copy ? PROT_READ | PROT_WRITE : PROT_READ;
+    AstVideocapLayout *layout = &test->layout;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t capacity, offset;
+    volatile const uint8_t *p;
+
+    if (layout->size == 0) {
+        layout->size = videocap_probe_size(test, prot);
+        if (layout->size == 0) {
+            printf("%s: the driver maps any size, using the default\n", __func__);
+            layout->size = AST_VIDEOCAP_MMAP_SIZE;
+        }
+    }
+    /* zero-copy needs room for the header right below the payload */
+    if (layout->cursor_offset < AST_VIDEOCAP_HDR_SIZE ||
+        layout->cursor_offset + sizeof(struct ast_videocap_cursor_info_t) + AST_VIDEOCAP_HDR_SIZE >
+        layout->data_offset ||
+        layout->data_offset >= layout->size) {
+        printf("%s: bad layout: size 0x%zx, cursor at 0x%zx, payload at 0x%zx\n", __func__,
+               layout->size, layout->cursor_offset, layout->data_offset);
+        return -1;
+    }
 
-    test->core->timer_start(test->wakeup_timer, test->wakeup_ms);
-    return TRUE;
+    test->mmap = mmap(NULL, layout->size, prot, MAP_SHARED | MAP_POPULATE,
+                      test->videocap_fd, 0);
+    if (test->mmap == MAP_FAILED) {
+        printf("unable to mmap videocap device: %d", errno);
+        return -1;
+    }
+    /* not every driver populates on request, touch every page as well */
+    for (p = test->mmap, offset = 0; offset < layout->size; offset += page) {
+        (void)p[offset];
+    }
+
+    capacity = layout->size - layout->data_offset;
+    printf("%s: 0x%zx bytes, cursor at 0x%zx, payload at 0x%zx, frames up to %zu KB\n",
+           __func__, layout->size, layout->cursor_offset, layout->data_offset,
+           capacity / 1024);
+
+    if (!test->decode_bitmaps) {
+        ast_buf_pool_init(&payload_pool, "payload", capacity + AST_VIDEOCAP_HDR_SIZE,
+                          test->frame_slots);
+        /* every slot's first copy of a typical frame comes from this class */
+        ast_buf_pool_prefault(&payload_pool, (capacity + AST_VIDEOCAP_HDR_SIZE) / 4,
+                              test->frame_slots);
+    }
+    if (test->mjpeg_stream) {
+        /* a rewrapped frame is rarely more than twice the engine's */
+        ast_buf_pool_init(&stream_pool, "stream", layout->size * 2, STREAM_MSGS);
+    }
+    return 0;
 }
 
-static void do_wakeup(void *opaque)
+static void capture_thread_start(Test *test)
 {
-    Test *test = opaque;
-    int notify;
-
-    int static init = 0;
-    test->cursor_notify = NOTIFY_CURSOR_BATCH;
+    test->capture_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (test->capture_event < 0) {
+        printf("%s: eventfd failed: %d, using the wakeup timer\n", __func__, errno);
+        test->capture_mode = CAPTURE_MODE_TIMER;
+        return;
+    }
+    test->capture_poll_dev = TRUE;
+    test->capture_thread = g_thread_new("ast-capture", capture_thread, test);
+}
 
-#if 0
-    SimpleSpiceUpdate *update = test_spice_create_update_from_bitmap(test, 0);
-    push_command(&update->ext);
-#else
-    if ((intptr_t)cmd_ext <= 0) {
-        //printf("=%p ", cmd_ext);
-        cmd_ext = test_spice_create_update_from_bitmap(test, 0);
-        //printf("+ %p\n", cmd_ext);
-        if (cmd_ext == NULL)
-            cmd_ext = (void *)-1;
+void ast_start_capture(Test *test)
+{
+    compress_init(test);
+    if (test->capture_mode == CAPTURE_MODE_THREAD) {
+        capture_thread_start(test);
     }
-#endif
 
-//    printf("--do_wakeup: %p\n", cmd_ext);
-    test->core->timer_start(test->wakeup_timer, test->wakeup_ms);
-    spice_qxl_wakeup(&test->qxl_instance);
+    /* runs once to park the engine in timer mode, then waits for a viewer */
+    wakeup_schedule(test, test->wakeup_ms);
+
+    /* after every thread is created, so they don't inherit the main loop's policy */
+    ast_sched_apply(&test->sched_input, "main loop");
+    if (test->mlock && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        printf("%s: mlockall failed: %d\n", __func__, errno);
+    }
 }
 
-static void release_resource(SPICE_GNUC_UNUSED QXLInstance *qin,
+static void release_resource(QXLInstance *qin,
                              struct QXLReleaseInfoExt release_info)
 {
+    Test *test = SPICE_CONTAINEROF(qin, Test, qxl_instance);
     QXLCommandExt *ext = (QXLCommandExt*)(unsigned long)release_info.info->id;
     if (ext->cmd.type != QXL_CMD_CURSOR) {
     //    printf("release: %p %p\n", release_info.info, ext);
@@ -447,12 +2450,14 @@ static void release_resource(SPICE_GNUC_UNUSED QXLInstance *qin,
     switch (ext->cmd.type) {
         case QXL_CMD_DRAW:
             if (ext) {
-                cmd_ext = NULL;
-                SimpleSpiceUpdate *update = (SimpleSpiceUpdate *)ext;
-#if _VAR1
-                free(update->bitmap);
-#endif
-                free(update);
+                /* the update is the first member of its slot */
+                FrameSlot *slot = (FrameSlot *)ext;
+
+                ast_pacing_release(&test->pacing,
+                                   g_get_monotonic_time() - slot->queued_time);
+                frame_slot_recycle(slot);
+                STAT_ADD(released, 1);
+                capture_kick(test);
             }
             break;
         case QXL_CMD_SURFACE:
@@ -463,14 +2468,9 @@ static void release_resource(SPICE_GNUC_UNUSED QXLInstance *qin,
 #endif
             free(ext);
             break;
-        case QXL_CMD_CURSOR: {
-            QXLCursorCmd *cmd = (QXLCursorCmd *)(unsigned long)ext->cmd.data;
-            if (cmd->type == QXL_CURSOR_SET) {
-                free(cmd);
-            }
-            free(ext);
+        case QXL_CMD_CURSOR:
+            ast_pool_put(&cursor_pool, ext);
             break;
-        }
         default:
             abort();
     }
@@ -507,42 +2507,60 @@ static void cursor_init()
 static int get_cursor_command(QXLInstance *qin, struct QXLCommandExt *ext)
 {
     Test *test = SPICE_CONTAINEROF(qin, Test, qxl_instance);
-    static int set = 1;
     static int x = 0, y = 0;
     QXLCursorCmd *cursor_cmd;
     QXLCommandExt *cmd;
+    CursorUpdate *update;
     struct ast_videocap_cursor_info_t *cur;
+    gint64 notify_time;
 
-    if (!test->started) return FALSE;
+    if (!test->cursor.sched_applied) {
+        /* the worker thread is spice's, this is the first chance to set it up */
+        ast_sched_apply(&test->sched_cursor, "cursor");
+        test->cursor.sched_applied = TRUE;
+    }
+    if (!__atomic_load_n(&test->started, __ATOMIC_RELAXED)) return FALSE;
 
 //    return FALSE;
 
-    if (!test->cursor_notify) {
+    if (!__atomic_load_n(&test->cursor.notify, __ATOMIC_RELAXED)) {
         return FALSE;
     }
 
-    test->cursor_notify--;
-    cmd = calloc(sizeof(QXLCommandExt), 1);
-    cursor_cmd = calloc(sizeof(QXLCursorCmd), 1);
+    update = ast_pool_get(&cursor_pool);
+    if (update == NULL) {
+        return FALSE;
+    }
+    __atomic_sub_fetch(&test->cursor.notify, 1, __ATOMIC_RELAXED);
+    notify_time = __atomic_exchange_n(&test->cursor.notify_time, 0, __ATOMIC_RELAXED);
+    if (notify_time) {
+        /* the main loop woke the worker for this poll */
+        ast_deadline_check(&test->deadline_cursor, notify_time, g_get_monotonic_time());
+    }
+    memset(update, 0, sizeof(*update));
+    cmd = &update->ext;
+    cursor_cmd = &update->cmd;
 
     cursor_cmd->release_info.id = (unsigned long)cmd;
 
-    bzero(&test->ioc, sizeof(ASTCap_Ioctl));
-    test->ioc.OpCode = ASTCAP_IOCTL_GET_CURSOR;
-    ioctl(test->videocap_fd, ASTCAP_IOCCMD, &test->ioc);
-
-    if (test->ioc.Size) {
-//        printf("cursor size=%d @ %d, %d\n", test->ioc.Size, test->curinfo.pos_x, test->curinfo.pos_y);
-        memcpy(&test->curinfo, (int8_t *)test->mmap + 0x1000, test->ioc.Size);
-        test->pointer.last_x = test->curinfo.pos_x;
-        test->pointer.last_y = test->curinfo.pos_y;
-        if (test->ioc.Size > 13) {
-//            printf("--> new cursor: %d, off %d,%d\n", test->curinfo.type, test->curinfo.offset_x, test->curinfo.offset_y);
-            cursor.cursor.header.type = test->curinfo.type ? SPICE_CURSOR_TYPE_ALPHA : SPICE_CURSOR_TYPE_MONO;
-            cursor.cursor.header.width = CURSOR_WIDTH - test->curinfo.offset_x;
-            cursor.cursor.header.height = CURSOR_HEIGHT - test->curinfo.offset_y;
+    bzero(&test->cursor.ioc, sizeof(ASTCap_Ioctl));
+    test->cursor.ioc.OpCode = ASTCAP_IOCTL_GET_CURSOR;
+    ioctl(test->videocap_fd, ASTCAP_IOCCMD, &test->cursor.ioc);
+
+    if (test->cursor.ioc.Size) {
+//        printf("cursor size=%d @ %d, %d\n", test->cursor.ioc.Size, test->cursor.curinfo.pos_x, test->cursor.curinfo.pos_y);
+        memcpy(&test->cursor.curinfo, (int8_t *)test->mmap + test->layout.cursor_offset,
+               MIN(test->cursor.ioc.Size, sizeof(test->cursor.curinfo)));
+        /* shared with the input side on the main loop */
+        __atomic_store_n(&test->pointer.last_x, test->cursor.curinfo.pos_x, __ATOMIC_RELAXED);
+        __atomic_store_n(&test->pointer.last_y, test->cursor.curinfo.pos_y, __ATOMIC_RELAXED);
+        if (test->cursor.ioc.Size > 13) {
+//            printf("--> new cursor: %d, off %d,%d\n", test->cursor.curinfo.type, test->cursor.curinfo.offset_x, test->cursor.curinfo.offset_y);
+            cursor.cursor.header.type = test->cursor.curinfo.type ? SPICE_CURSOR_TYPE_ALPHA : SPICE_CURSOR_TYPE_MONO;
+            cursor.cursor.header.width = CURSOR_WIDTH - test->cursor.curinfo.offset_x;
+            cursor.cursor.header.height = CURSOR_HEIGHT - test->cursor.curinfo.offset_y;
             int bpl = (cursor.cursor.header.width + 7) / 8;
-            if (test->curinfo.type == 0) {
+            if (test->cursor.curinfo.type == 0) {
                 memset(cursor.data, 0xff, bpl * cursor.cursor.header.height);
                 memset(cursor.data + bpl * cursor.cursor.header.height, 0, bpl * cursor.cursor.header.height);
                 cursor.cursor.data_size = (bpl * cursor.cursor.header.height * 2) + 128;
@@ -551,12 +2569,12 @@ static int get_cursor_command(QXLInstance *qin, struct QXLCommandExt *ext)
             }
             cursor.cursor.chunk.data_size = cursor.cursor.data_size;
             cursor.cursor.chunk.prev_chunk = cursor.cursor.chunk.next_chunk = 0;
-            for (y = 0, x = test->curinfo.offset_y * CURSOR_WIDTH + test->curinfo.offset_x;
+            for (y = 0, x = test->cursor.curinfo.offset_y * CURSOR_WIDTH + test->cursor.curinfo.offset_x;
                  y < cursor.cursor.header.height;
                  y++, x += CURSOR_WIDTH) {
                 for (int j = 0; j<cursor.cursor.header.width; j++) {
-                    int32_t data = test->curinfo.pattern[x + j];
-                    if (test->curinfo.type == 1) {
+                    int32_t data = test->cursor.curinfo.pattern[x + j];
+                    if (test->cursor.curinfo.type == 1) {
                     uint8_t color[3];
 #if 1
                     color[0] = ((data & 0xf00) >> 4) | ((data & 0xf00) >> 8);
@@ -585,28 +2603,28 @@ static int get_cursor_command(QXLInstance *qin, struct QXLCommandExt *ext)
                     }
                 }
             }
-            set = 1;
+            test->cursor.shape_pending = TRUE;
         }
-    } else if (test->ioc.ErrCode == -2 && test->curinfo.type != 255) {
+    } else if (test->cursor.ioc.ErrCode == -2 && test->cursor.curinfo.type != 255) {
         printf("disable cursor\n");
-        test->curinfo.type = 255;
+        test->cursor.curinfo.type = 255;
         memset(cursor.data, 0, sizeof(cursor.data));
     }
 
-    if (set) {
-        cursor_cmd->type = test->curinfo.type == 255 ? QXL_CURSOR_HIDE : QXL_CURSOR_SET;
-        cursor_cmd->u.set.position.x = test->pointer.last_x;
-        cursor_cmd->u.set.position.y = test->pointer.last_y;
+    if (test->cursor.shape_pending) {
+        cursor_cmd->type = test->cursor.curinfo.type == 255 ? QXL_CURSOR_HIDE : QXL_CURSOR_SET;
+        cursor_cmd->u.set.position.x = __atomic_load_n(&test->pointer.last_x, __ATOMIC_RELAXED);
+        cursor_cmd->u.set.position.y = __atomic_load_n(&test->pointer.last_y, __ATOMIC_RELAXED);
         cursor_cmd->u.set.visible = TRUE;
         cursor_cmd->u.set.shape = (unsigned long)&cursor;
         // Only a white rect (32x32) as cursor
 //        memset(cursor.data, 255, sizeof(cursor.data));
-        set = 0;
-    } else if (test->curinfo.type != 255) {
+        test->cursor.shape_pending = FALSE;
+    } else if (test->cursor.curinfo.type != 255) {
         cursor_cmd->type = QXL_CURSOR_MOVE;
-        if (test->primary_width > 0) {
-            cursor_cmd->u.position.x = test->pointer.last_x; //x++ % test->primary_width;
-            cursor_cmd->u.position.y = test->pointer.last_y; //y++ % test->primary_height;
+        if (__atomic_load_n(&test->primary_width, __ATOMIC_RELAXED) > 0) {
+            cursor_cmd->u.position.x = __atomic_load_n(&test->pointer.last_x, __ATOMIC_RELAXED); //x++ % test->primary_width;
+            cursor_cmd->u.position.y = __atomic_load_n(&test->pointer.last_y, __ATOMIC_RELAXED); //y++ % test->primary_height;
         }
     } else {
         cursor_cmd->type = QXL_CURSOR_HIDE;
@@ -633,41 +2651,53 @@ static void notify_update(SPICE_GNUC_UNUSED QXLInstance *qin,
     printf("%s\n", __func__);
 }
 
-static int flush_resources(SPICE_GNUC_UNUSED QXLInstance *qin)
+static int flush_resources(QXLInstance *qin)
 {
+    Test *test = SPICE_CONTAINEROF(qin, Test, qxl_instance);
+
+    /* the worker is short of memory and drops what it and the clients
+     * hold, frames it had not sent yet included */
     printf("%s\n", __func__);
+    request_keyframe(test, KEYFRAME_CACHE_RESET);
     return TRUE;
 }
 
+/*
+ * The client's window size is only logged. Following it would need the
+ * engine's scaler, and SET_SCALAR_CONFIGS takes a payload whose layout the
+ * driver header doesn't give. Returning 0 leaves the resize to the agent.
+ */
 static int client_monitors_config(SPICE_GNUC_UNUSED QXLInstance *qin,
                                   VDAgentMonitorsConfig *monitors_config)
 {
+    uint32_t i;
+
     if (!monitors_config) {
         printf("%s: NULL monitors_config\n", __func__);
-    } else {
-        printf("%s: %d\n", __func__, monitors_config->num_of_monitors);
+        return 0;
+    }
+    printf("%s: %d\n", __func__, monitors_config->num_of_monitors);
+    for (i = 0; i < monitors_config->num_of_monitors; i++) {
+        printf("%s: monitor %u %ux%u+%d+%d\n", __func__, i,
+               monitors_config->monitors[i].width, monitors_config->monitors[i].height,
+               monitors_config->monitors[i].x, monitors_config->monitors[i].y);
     }
     return 0;
 }
 
+/* called with test->started still holding the previous number of viewers */
 void on_client_connected(Test *test)
 {
     if (test->started) {
-        bzero(&test->ioc, sizeof(ASTCap_Ioctl));
-        test->ioc.OpCode = ASTCAP_IOCTL_STOP_CAPTURE;
-        ioctl(test->videocap_fd, ASTCAP_IOCCMD, &test->ioc);
-
-        bzero(&test->ioc, sizeof(ASTCap_Ioctl));
-        test->ioc.OpCode = ASTCAP_IOCTL_START_CAPTURE;
-        ioctl(test->videocap_fd, ASTCAP_IOCCMD, &test->ioc);
+        /* The engine only sends what changed since its last frame, so the
+         * new viewer needs a full one. Ask the capture side for it rather
+         * than restarting capture under everyone already watching. */
+        request_keyframe(test, KEYFRAME_CLIENT);
     }
-    test->started++;
 }
 
-void on_client_disconnected(Test *test)
+void on_client_disconnected(SPICE_GNUC_UNUSED Test *test)
 {
-    if (test->started > 0)
-        test->started--;
 }
 
 static void set_client_capabilities(QXLInstance *qin,
@@ -676,15 +2706,72 @@ static void set_client_capabilities(QXLInstance *qin,
 {
     Test *test = SPICE_CONTAINEROF(qin, Test, qxl_instance);
 
+    /* The worker calls this whenever a display client comes or goes, with
+     * the capabilities all of them share, and can't tell which of the two
+     * it was. A client that just joined is attached by now, so whoever is
+     * attached gets a full frame and the cursor shape. */
     printf("%s: present %d caps %d\n", __func__, client_present, caps[0]);
-    if (test->on_client_connected && client_present) {
+    if (client_present) {
+        request_keyframe(test, KEYFRAME_CLIENT);
+        test->cursor.shape_pending = TRUE;
+    }
+}
+
+/* the number of display clients changed, main loop */
+static void viewers_update(Test *test, int viewers)
+{
+    printf("%s: %d viewers\n", __func__, viewers);
+    if (test->on_client_connected && viewers > test->started) {
         printf("! connected\n");
         test->on_client_connected(test);
     }
-    if (test->on_client_disconnected && !client_present) {
+    if (test->on_client_disconnected && viewers < test->started) {
         printf("! disconnected\n");
         test->on_client_disconnected(test);
     }
+    if (viewers && !test->started) {
+        __atomic_store_n(&test->resume_time, g_get_monotonic_time(), __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&test->started, viewers, __ATOMIC_SEQ_CST);
+
+    /* start or park the capture side */
+    capture_kick(test);
+    if (viewers && __atomic_exchange_n(&test->wakeup_parked, FALSE, __ATOMIC_SEQ_CST)) {
+        wakeup_schedule(test, 0);
+    }
+}
+
+/*
+ * Viewers are counted from the display channel's events rather than with
+ * spice_server_get_num_clients(), which counts main channel clients and
+ * walks reds' client list from whichever thread asks.
+ */
+static void display_channel_event(int event, SpiceChannelEventInfo *info, void *opaque)
+{
+    Test *test = opaque;
+    gpointer id = GUINT_TO_POINTER(info->connection_id);
+    gint64 now = g_get_monotonic_time();
+    ViewerLink *link;
+
+    if (info->type != SPICE_CHANNEL_DISPLAY) {
+        return;
+    }
+    if (event == SPICE_CHANNEL_EVENT_INITIALIZED) {
+        link = g_new0(ViewerLink, 1);
+        link->connection_id = info->connection_id;
+        link->joined = now;
+        link->delivered = STAT_GET(delivered);
+        link->lag_us = lag_total_us(now);
+        g_hash_table_replace(test->display_links, id, link);
+    } else if (event == SPICE_CHANNEL_EVENT_DISCONNECTED &&
+               (link = g_hash_table_lookup(test->display_links, id)) != NULL) {
+        viewer_print(link, " left", now,
+                     __atomic_load_n(&test->pacing.release_us, __ATOMIC_RELAXED));
+        g_hash_table_remove(test->display_links, id);
+    } else {
+        return;
+    }
+    viewers_update(test, g_hash_table_size(test->display_links));
 }
 
 QXLInterface display_sif = {
@@ -711,6 +2798,427 @@ QXLInterface display_sif = {
     .set_client_capabilities = set_client_capabilities,
 };
 
+/* the capture side queued a message, let spice read it */
+static void stream_port_watch(int fd, SPICE_GNUC_UNUSED int event, SPICE_GNUC_UNUSED void *opaque)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0) {
+        /* nothing pending */
+    }
+    spice_server_char_device_wakeup(&stream_port.sin);
+}
+
+static int stream_port_read(SPICE_GNUC_UNUSED SpiceCharDeviceInstance *sin,
+                            uint8_t *buf, int len)
+{
+    int n = 0;
+
+    while (n < len) {
+        size_t chunk;
+
+        if (stream_port.msg == NULL) {
+            stream_port.msg = ast_ring_pop(&stream_port.ring);
+            stream_port.pos = 0;
+            if (stream_port.msg == NULL) {
+                break;
+            }
+        }
+        chunk = MIN((size_t)(len - n), stream_port.msg->len - stream_port.pos);
+        memcpy(buf + n, stream_port.msg->data + stream_port.pos, chunk);
+        n += chunk;
+        stream_port.pos += chunk;
+        if (stream_port.pos == stream_port.msg->len) {
+            ast_buf_pool_put(&stream_pool, stream_port.msg);
+            stream_port.msg = NULL;
+        }
+    }
+    return n;
+}
+
+static void stream_port_set_started(int started)
+{
+    if (started) {
+        __atomic_store_n(&stream_port.restart, TRUE, __ATOMIC_RELEASE);
+    }
+    if (!__atomic_exchange_n(&stream_port.started, started, __ATOMIC_ACQ_REL) || started) {
+        return;
+    }
+    /* no frame went down the display channel while the stream ran, the
+     * clients' decoders hold a reference the engine moved on from */
+    request_keyframe(stream_port.test, KEYFRAME_STREAM);
+}
+
+static void stream_port_handle(const StreamDevHeader *hdr, const uint8_t *data, size_t size)
+{
+    const StreamMsgStartStop *start = (const StreamMsgStartStop *)data;
+    int started = FALSE;
+    int i;
+
+    if (GUINT16_FROM_LE(hdr->type) != STREAM_TYPE_START_STOP || size < 1) {
+        /* capabilities: we have none to announce */
+        return;
+    }
+    for (i = 0; i < start->num_codecs && 1 + (size_t)i < size; i++) {
+        if (start->codecs[i] == SPICE_VIDEO_CODEC_TYPE_MJPEG) {
+            started = TRUE;
+        }
+    }
+    printf("%s: stream %s\n", __func__, started ? "started" : "stopped");
+    stream_port_set_started(started);
+}
+
+/* spice's messages are a few bytes, they are collected a byte at a time */
+static int stream_port_write(SPICE_GNUC_UNUSED SpiceCharDeviceInstance *sin,
+                             const uint8_t *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        StreamDevHeader hdr;
+
+        if (stream_port.in_len < sizeof(stream_port.in)) {
+            stream_port.in[stream_port.in_len] = buf[i];
+        }
+        stream_port.in_len++;
+        if (stream_port.in_len < sizeof(hdr)) {
+            continue;
+        }
+        memcpy(&hdr, stream_port.in, sizeof(hdr));
+        if (stream_port.in_len == sizeof(hdr) + GUINT32_FROM_LE(hdr.size)) {
+            stream_port_handle(&hdr, stream_port.in + sizeof(hdr),
+                               MIN(stream_port.in_len, sizeof(stream_port.in)) - sizeof(hdr));
+            stream_port.in_len = 0;
+        }
+    }
+    return len;
+}
+
+static void stream_port_state(SPICE_GNUC_UNUSED SpiceCharDeviceInstance *sin,
+                              int connected)
+{
+    if (!connected) {
+        /* the streaming channel went away without a stop message */
+        stream_port_set_started(FALSE);
+    }
+}
+
+static SpiceCharDeviceInterface stream_port_sif = {
+    .base = {
+        .type = SPICE_INTERFACE_CHAR_DEVICE,
+        .description = "AST MJPEG stream",
+        .major_version = SPICE_INTERFACE_CHAR_DEVICE_MAJOR,
+        .minor_version = SPICE_INTERFACE_CHAR_DEVICE_MINOR
+    },
+    .state = stream_port_state,
+    .write = stream_port_write,
+    .read = stream_port_read,
+};
+
+static void stream_port_init(Test *test)
+{
+    stream_port.test = test;
+    stream_port.event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stream_port.event < 0) {
+        printf("%s: eventfd failed: %d, no MJPEG stream\n", __func__, errno);
+        test->mjpeg_stream = FALSE;
+        return;
+    }
+    ast_mjpeg_init(&stream_port.mjpeg);
+    ast_ring_init(&stream_port.ring);
+    /* stream_pool is sized by ast_map_videocap() */
+    stream_port.watch = test->core->watch_add(stream_port.event, SPICE_WATCH_EVENT_READ,
+                                              stream_port_watch, test);
+
+    stream_port.sin.base.sif = &stream_port_sif.base;
+    stream_port.sin.subtype = "port";
+    stream_port.sin.portname = STREAM_PORT_NAME;
+    spice_server_add_interface(test->server, &stream_port.sin.base);
+    spice_server_port_event(&stream_port.sin, SPICE_PORT_EVENT_OPENED);
+}
+
+static void usage(const char *argv0)
+{
+    printf("usage: %s [options]\n"
+           "  --zero-copy             hand the mapped capture buffer to spice without copying\n"
+           "                          (implies --frame-slots=1)\n"
+           "  --frame-slots=N         frames in flight between capture and delivery (1-%d, default %d)\n"
+           "  --queue-policy=POLICY   fifo queues frames for the worker, latest captures\n"
+           "                          the next frame only once the worker took the last\n"
+           "                          (default fifo)\n"
+           "  --capture=MODE          thread captures on a dedicated thread and wakes\n"
+           "                          spice on new frames, timer polls every %d ms\n"
+           "                          from the main loop (default thread)\n"
+           "  --min-fps=N             idle capture rate of the pacing governor (default %d)\n"
+           "  --max-fps=N             capture rate while the screen changes (default %d)\n"
+           "  --partial-updates       draw only the macroblocks the engine reports as\n"
+           "                          changed instead of the whole screen\n"
+           "  --max-kbps=N            lower the engine quality to keep the video stream\n"
+           "                          under N kbit/s\n"
+           "  --max-latency=MS        lower the engine quality while frames take longer\n"
+           "                          than MS to be released by the clients\n"
+           "  --refine=MS             encode at the motion level or coarser while the\n"
+           "                          screen changes, once it is static for MS send one\n"
+           "                          full frame at the best quality\n"
+           "  --motion-level=N        quality level used while moving with --refine,\n"
+           "                          0 (best) - 7 (default %d)\n"
+           "  --budget=KBPS           bandwidth all viewers together may take, frames\n"
+           "                          over it are skipped, not queued; counted in\n"
+           "                          compressed engine bytes, also with --image=bitmap\n"
+           "  --client-budget=KBPS    bandwidth each viewer may take\n"
+           "  --mode-debounce=MS      wait until a new source mode is stable for MS\n"
+           "                          before resizing the display (default %d)\n"
+           "  --lag-latest=MS         with several viewers, capture only once the last frame\n"
+           "                          was released while that takes longer than MS\n"
+           "                          (default %d, 0 disables); QXL releases a frame once\n"
+           "                          every viewer has it, so none can fall back on its\n"
+           "                          own: all of them run at the slowest one's pace\n"
+           "  --no-dedupe             send frames whose payload repeats the last one\n"
+           "  --image=TYPE            ast sends the engine's stream for the client to\n"
+           "                          decode, bitmap decodes it here for stock clients\n"
+           "                          (default ast)\n"
+           "  --scalar-decode         use the scalar decoder kernels with --image=bitmap\n"
+           "  --no-image-cache        don't let clients cache the bitmaps of --image=bitmap;\n"
+           "                          only those are cached, --image=ast frames never are\n"
+           "  --mjpeg-stream          rewrap frames as MJPEG for spice's stream channel\n"
+           "                          while a client takes it\n"
+           "  --quant-tables=FILE     the engine's quant tables, which --image=bitmap and\n"
+           "                          --mjpeg-stream need: for table 0 to 11, 64 luma then\n"
+           "                          64 chroma values in natural order\n"
+           "  --sched-capture=SPEC    CPUs and scheduling policy of the capture thread;\n"
+           "                          SPEC is a list of cpu=N, fifo=PRIO, rr=PRIO or\n"
+           "                          other, e.g. cpu=1,fifo=40\n"
+           "  --sched-cursor=SPEC     the same for spice's worker thread, which polls\n"
+           "                          the cursor and sends the display\n"
+           "  --sched-input=SPEC      the same for the main loop, which runs the input\n"
+           "                          devices (and capture with --capture=timer)\n"
+           "  --mlockall              lock all memory to keep page faults off the console path\n"
+           "  --videocap-layout=SIZE[,CURSOR,DATA]\n"
+           "                          size of the capture buffer and offsets of the cursor\n"
+           "                          info and the payload in it (default: size probed,\n"
+           "                          offsets 0x%x,0x%x)\n"
+           "  --watchdog=MS           recover the video engine once it failed or repeated\n"
+           "                          frames for MS (default %d, 0 disables)\n"
+           "  --dump-frames           save every captured frame to /tmp/videocap.bin\n"
+           "  --stats-interval=SECS   print pipeline statistics every SECS seconds\n"
+           "  -h, --help              show this help\n",
+           argv0, FRAME_SLOTS_MAX, FRAME_SLOTS_DEFAULT, WAKEUP_MS_DEFAULT,
+           AST_PACING_MIN_FPS_DEFAULT, AST_PACING_MAX_FPS_DEFAULT,
+           AST_COMPRESS_MOTION_LEVEL_DEFAULT, MODE_DEBOUNCE_MS_DEFAULT, LAG_LATEST_MS_DEFAULT,
+           AST_VIDEOCAP_CURSOR_OFFSET, AST_VIDEOCAP_DATA_OFFSET,
+           AST_WATCHDOG_STALL_MS_DEFAULT);
+}
+
+void spice_test_config_parse_args(int argc, char **argv)
+{
+    enum {
+        OPT_ZERO_COPY = 256,
+        OPT_FRAME_SLOTS,
+        OPT_STATS_INTERVAL,
+        OPT_QUEUE_POLICY,
+        OPT_CAPTURE,
+        OPT_MIN_FPS,
+        OPT_MAX_FPS,
+        OPT_DUMP_FRAMES,
+        OPT_PARTIAL_UPDATES,
+        OPT_MAX_KBPS,
+        OPT_MAX_LATENCY,
+        OPT_REFINE,
+        OPT_MOTION_LEVEL,
+        OPT_BUDGET,
+        OPT_CLIENT_BUDGET,
+        OPT_MODE_DEBOUNCE,
+        OPT_IMAGE,
+        OPT_SCALAR_DECODE,
+        OPT_MJPEG_STREAM,
+        OPT_QUANT_TABLES,
+        OPT_LAG_LATEST,
+        OPT_NO_DEDUPE,
+        OPT_NO_IMAGE_CACHE,
+        OPT_SCHED_CAPTURE,
+        OPT_SCHED_CURSOR,
+        OPT_SCHED_INPUT,
+        OPT_MLOCKALL,
+        OPT_VIDEOCAP_LAYOUT,
+        OPT_WATCHDOG,
+    };
+    static const struct option long_options[] = {
+        {"zero-copy", no_argument, NULL, OPT_ZERO_COPY},
+        {"frame-slots", required_argument, NULL, OPT_FRAME_SLOTS},
+        {"stats-interval", required_argument, NULL, OPT_STATS_INTERVAL},
+        {"queue-policy", required_argument, NULL, OPT_QUEUE_POLICY},
+        {"capture", required_argument, NULL, OPT_CAPTURE},
+        {"min-fps", required_argument, NULL, OPT_MIN_FPS},
+        {"max-fps", required_argument, NULL, OPT_MAX_FPS},
+        {"dump-frames", no_argument, NULL, OPT_DUMP_FRAMES},
+        {"partial-updates", no_argument, NULL, OPT_PARTIAL_UPDATES},
+        {"max-kbps", required_argument, NULL, OPT_MAX_KBPS},
+        {"max-latency", required_argument, NULL, OPT_MAX_LATENCY},
+        {"refine", required_argument, NULL, OPT_REFINE},
+        {"motion-level", required_argument, NULL, OPT_MOTION_LEVEL},
+        {"budget", required_argument, NULL, OPT_BUDGET},
+        {"client-budget", required_argument, NULL, OPT_CLIENT_BUDGET},
+        {"mode-debounce", required_argument, NULL, OPT_MODE_DEBOUNCE},
+        {"image", required_argument, NULL, OPT_IMAGE},
+        {"scalar-decode", no_argument, NULL, OPT_SCALAR_DECODE},
+        {"mjpeg-stream", no_argument, NULL, OPT_MJPEG_STREAM},
+        {"quant-tables", required_argument, NULL, OPT_QUANT_TABLES},
+        {"lag-latest", required_argument, NULL, OPT_LAG_LATEST},
+        {"no-dedupe", no_argument, NULL, OPT_NO_DEDUPE},
+        {"no-image-cache", no_argument, NULL, OPT_NO_IMAGE_CACHE},
+        {"sched-capture", required_argument, NULL, OPT_SCHED_CAPTURE},
+        {"sched-cursor", required_argument, NULL, OPT_SCHED_CURSOR},
+        {"sched-input", required_argument, NULL, OPT_SCHED_INPUT},
+        {"mlockall", no_argument, NULL, OPT_MLOCKALL},
+        {"videocap-layout", required_argument, NULL, OPT_VIDEOCAP_LAYOUT},
+        {"watchdog", required_argument, NULL, OPT_WATCHDOG},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_ZERO_COPY:
+            options.zero_copy = 1;
+            break;
+        case OPT_FRAME_SLOTS:
+            options.frame_slots = CLAMP(atoi(optarg), 1, FRAME_SLOTS_MAX);
+            break;
+        case OPT_STATS_INTERVAL:
+            options.stats_interval = MAX(atoi(optarg), 0);
+            break;
+        case OPT_QUEUE_POLICY:
+            if (strcmp(optarg, "fifo") == 0) {
+                options.queue_policy = QUEUE_POLICY_FIFO;
+            } else if (strcmp(optarg, "latest") == 0) {
+                options.queue_policy = QUEUE_POLICY_LATEST;
+            } else {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case OPT_CAPTURE:
+            if (strcmp(optarg, "thread") == 0) {
+                options.capture_mode = CAPTURE_MODE_THREAD;
+            } else if (strcmp(optarg, "timer") == 0) {
+                options.capture_mode = CAPTURE_MODE_TIMER;
+            } else {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case OPT_MIN_FPS:
+            options.min_fps = CLAMP(atoi(optarg), 1, 1000);
+            break;
+        case OPT_MAX_FPS:
+            options.max_fps = CLAMP(atoi(optarg), 1, 1000);
+            break;
+        case OPT_DUMP_FRAMES:
+            options.dump_frames = 1;
+            break;
+        case OPT_PARTIAL_UPDATES:
+            options.partial_updates = 1;
+            break;
+        case OPT_MAX_KBPS:
+            options.max_kbps = MAX(atoi(optarg), 0);
+            break;
+        case OPT_MAX_LATENCY:
+            options.max_latency = MAX(atoi(optarg), 0);
+            break;
+        case OPT_REFINE:
+            options.refine_ms = MAX(atoi(optarg), 0);
+            break;
+        case OPT_MOTION_LEVEL:
+            options.motion_level = atoi(optarg);
+            break;
+        case OPT_BUDGET:
+            options.budget_kbps = MAX(atoi(optarg), 0);
+            break;
+        case OPT_CLIENT_BUDGET:
+            options.client_budget_kbps = MAX(atoi(optarg), 0);
+            break;
+        case OPT_MODE_DEBOUNCE:
+            options.mode_debounce_ms = MAX(atoi(optarg), 0);
+            break;
+        case OPT_IMAGE:
+            if (strcmp(optarg, "ast") == 0) {
+                options.decode_bitmaps = 0;
+            } else if (strcmp(optarg, "bitmap") == 0) {
+                options.decode_bitmaps = 1;
+            } else {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case OPT_SCALAR_DECODE:
+            options.scalar_decode = 1;
+            break;
+        case OPT_MJPEG_STREAM:
+            options.mjpeg_stream = 1;
+            break;
+        case OPT_QUANT_TABLES:
+            options.quant_tables = optarg;
+            break;
+        case OPT_LAG_LATEST:
+            options.lag_latest_ms = MAX(atoi(optarg), 0);
+            break;
+        case OPT_NO_DEDUPE:
+            options.no_dedupe = 1;
+            break;
+        case OPT_NO_IMAGE_CACHE:
+            options.no_image_cache = 1;
+            break;
+        case OPT_SCHED_CAPTURE:
+        case OPT_SCHED_CURSOR:
+        case OPT_SCHED_INPUT:
+            if (ast_sched_parse(opt == OPT_SCHED_CAPTURE ? &options.sched_capture :
+                                opt == OPT_SCHED_CURSOR ? &options.sched_cursor :
+                                &options.sched_input, optarg) < 0) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case OPT_MLOCKALL:
+            options.mlockall = 1;
+            break;
+        case OPT_VIDEOCAP_LAYOUT: {
+            gchar **fields = g_strsplit(optarg, ",", -1);
+            int n = g_strv_length(fields);
+
+            if (n != 1 && n != 3) {
+                usage(argv[0]);
+                exit(1);
+            }
+            options.layout.size = strtoul(fields[0], NULL, 0);
+            if (n == 3) {
+                options.layout.cursor_offset = strtoul(fields[1], NULL, 0);
+                options.layout.data_offset = strtoul(fields[2], NULL, 0);
+            }
+            g_strfreev(fields);
+            break;
+        }
+        case OPT_WATCHDOG:
+            options.watchdog_ms = MAX(atoi(optarg), 0);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    /* both work on the engine's coefficients, which only its own tables
+     * turn back into pixels */
+    if ((options.decode_bitmaps || options.mjpeg_stream) &&
+        (options.quant_tables == NULL || ast_quant_tables_load(options.quant_tables) < 0)) {
+        printf("--image=bitmap and --mjpeg-stream need the engine's quant tables, "
+               "see --quant-tables\n");
+        exit(1);
+    }
+}
+
 Test *ast_new(SpiceCoreInterface *core)
 {
     int port = 5701; //5912;
@@ -721,10 +3229,49 @@ Test *ast_new(SpiceCoreInterface *core)
     test->qxl_instance.id = 0;
 
     test->started = 0;
+    test->display_links = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    basic_event_loop_set_channel_event(display_channel_event, test);
     test->core = core;
     test->server = server;
-    test->wakeup_ms = 50;
-    test->cursor_notify = NOTIFY_CURSOR_BATCH;
+    test->wakeup_ms = WAKEUP_MS_DEFAULT;
+    test->capture_mode = options.capture_mode;
+    test->capture_event = -1;
+    ast_pacing_init(&test->pacing, options.min_fps, options.max_fps);
+    test->decode_bitmaps = options.decode_bitmaps;
+    /* bitmaps are decoded straight from the mapping, never handed over */
+    test->zero_copy = options.zero_copy && !test->decode_bitmaps;
+    /* the mapping holds exactly one frame */
+    test->frame_slots = test->zero_copy ? 1 : options.frame_slots;
+    test->stats_interval = options.stats_interval;
+    test->queue_policy = options.queue_policy;
+    ast_ring_init(&frame_ring);
+    test->dump_frames = options.dump_frames && !test->zero_copy;
+    test->partial_updates = options.partial_updates;
+    ast_compress_init(&test->compress, options.max_kbps, options.max_latency);
+    ast_compress_set_refine(&test->compress, options.refine_ms, options.motion_level);
+    ast_budget_init(&test->budget, options.budget_kbps, options.client_budget_kbps);
+    test->mode_debounce_ms = options.mode_debounce_ms;
+    test->lag_latest_ms = options.lag_latest_ms;
+    test->dedupe = !options.no_dedupe;
+    test->image_cache = test->decode_bitmaps && !options.no_image_cache;
+    test->sched_capture = options.sched_capture;
+    test->sched_cursor = options.sched_cursor;
+    test->sched_input = options.sched_input;
+    test->mlock = options.mlockall;
+    ast_deadline_init(&test->deadline_capture, "capture");
+    ast_deadline_init(&test->deadline_cursor, "cursor");
+    ast_deadline_init(&test->deadline_input, "main loop");
+    ast_watchdog_init(&test->watchdog, options.watchdog_ms);
+    test->layout = options.layout;
+    if (test->decode_bitmaps) {
+        ast_decoder_init(&decoder, !options.scalar_decode);
+        ast_buf_pool_init(&payload_pool, "bitmap", MAX_WIDTH * MAX_HEIGHT * 4,
+                          test->frame_slots);
+    }
+    /* otherwise payload_pool is sized by ast_map_videocap() */
+    ast_pool_init(&cursor_pool, "cursor", sizeof(CursorUpdate), CURSOR_POOL_SIZE, TRUE);
+    test->cursor.notify = NOTIFY_CURSOR_BATCH;
+    test->cursor.shape_pending = TRUE;
     // some common initialization for all display tests
     printf("TESTER: listening on port %d (unsecure)\n", port);
     spice_server_set_port(server, port);
@@ -734,13 +3281,22 @@ Test *ast_new(SpiceCoreInterface *core)
 //    spice_server_set_video_codecs(test->server, "aspeed:aspeed");
 //    spice_server_set_image_compression(test->server, SPICE_IMAGE_COMPRESSION_OFF);
     spice_server_set_streaming_video(test->server, SPICE_STREAM_VIDEO_OFF);
+    test->mjpeg_stream = options.mjpeg_stream;
+    if (test->mjpeg_stream) {
+        stream_port_init(test);
+    }
 
     cursor_init();
-    test->curinfo.type = 255;
+    test->cursor.curinfo.type = 255;
     path_init(&path, 0, angle_parts);
     test->on_client_connected = on_client_connected;
     test->on_client_disconnected = on_client_disconnected;
     test->wakeup_timer = core->timer_add(do_wakeup, test);
+    if (test->stats_interval > 0) {
+        pipeline_stats.last_report = g_get_monotonic_time();
+        test->stats_timer = core->timer_add(print_stats, test);
+        core->timer_start(test->stats_timer, test->stats_interval * 1000);
+    }
 
     // test_add_display_interface
     spice_server_add_interface(test->server, &test->qxl_instance.base);